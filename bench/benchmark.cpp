@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <variant>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "JITCompiler.hpp"
+#include "ast.hpp"
+#include "environment.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+
+namespace
+{
+
+/// A synthetic program of at least one form per unit of `size`. Each one defines `(entry x)`, which the call stage
+/// runs.
+struct Program
+{
+    std::string name;
+    std::uint64_t size;
+    std::string source;
+};
+
+/// `size` independent definitions; `entry` calls the last one.
+Program many_definitions(const std::uint64_t size)
+{
+    auto source = std::string();
+    for (auto idx = std::uint64_t(0); idx < size; ++idx)
+    {
+        source += std::format("(define (f{} x y) (+ (* x y) (- x {})))\n", idx, idx);
+    }
+    source += std::format("(define (entry x) (f{} x x))\n", size - 1u);
+    return Program{"definitions", size, std::move(source)};
+}
+
+/// One definition whose body nests `size` additions.
+Program deep_nesting(const std::uint64_t size)
+{
+    auto source = std::string("(define (entry x) ");
+    for (auto idx = std::uint64_t(0); idx < size; ++idx)
+    {
+        source += "(+ x ";
+    }
+    source += "1";
+    source.append(size, ')');
+    source += ")\n";
+    return Program{"nesting", size, std::move(source)};
+}
+
+/// `size` functions, each calling the previous one.
+Program call_chain(const std::uint64_t size)
+{
+    auto source = std::string("(define (c0 x) (+ x 1))\n");
+    for (auto idx = std::uint64_t(1); idx < size; ++idx)
+    {
+        source += std::format("(define (c{} x) (c{} (+ x 1)))\n", idx, idx - 1u);
+    }
+    source += std::format("(define (entry x) (c{} x))\n", size - 1u);
+    return Program{"call_chain", size, std::move(source)};
+}
+
+using Clock = std::chrono::steady_clock;
+
+/// Keeps the results of the native calls alive, so the call loop is not optimized away.
+volatile double benchmark_sink = 0.0;
+
+std::uint64_t elapsed_ns(const Clock::time_point start)
+{
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    return static_cast<std::uint64_t>(elapsed.count());
+}
+
+/// Timings of one stage over all repetitions. `items` is what the stage processes per repetition: tokens, forms,
+/// functions or calls.
+struct Stage
+{
+    std::string name;
+    std::uint64_t items = 0u;
+    std::vector<std::uint64_t> samples_ns{};
+};
+
+ks::Lexer lex_from(const std::string& source)
+{
+    return ks::Lexer(llvm::MemoryBuffer::getMemBuffer(source, "<benchmark>", /*RequiresNullTerminator=*/false));
+}
+
+/// Runs every stage on `program` `repetitions` times. Each repetition gets a fresh JIT, so definitions never clash.
+llvm::Expected<std::vector<Stage>> run_program(const Program& program, const unsigned repetitions,
+                                               const std::uint64_t calls)
+{
+    auto stages = std::vector<Stage>{{"lex"}, {"parse"}, {"codegen"}, {"add_to_jit"}, {"materialize"}, {"call"}};
+    auto& lex = stages[0];
+    auto& parse = stages[1];
+    auto& codegen = stages[2];
+    auto& add_to_jit = stages[3];
+    auto& materialize = stages[4];
+    auto& call = stages[5];
+    for (auto rep = 0u; rep < repetitions; ++rep)
+    {
+        auto lexer = lex_from(program.source);
+        auto start = Clock::now();
+        auto tokens = std::uint64_t(0);
+        while (lexer.get_token().ty != ks::TokenType::END_OF_FILE)
+        {
+            ++tokens;
+        }
+        lex.samples_ns.push_back(elapsed_ns(start));
+        lex.items = tokens;
+
+        auto parser = ks::Parser(lex_from(program.source), /*_echo=*/false);
+        auto functions = std::vector<std::unique_ptr<ks::FunctionAST>>();
+        start = Clock::now();
+        while (auto result = parser.parse_top_level())
+        {
+            if (auto fun = std::get_if<std::unique_ptr<ks::FunctionAST>>(&*result))
+            {
+                functions.push_back(std::move(*fun));
+            }
+        }
+        parse.samples_ns.push_back(elapsed_ns(start));
+        parse.items = functions.size();
+        if (!parser.reached_end_of_input())
+        {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                           std::format("Failed to parse the `{}` program", program.name));
+        }
+
+        auto jit_compiler = ks::JITCompiler::create();
+        if (!jit_compiler)
+        {
+            return jit_compiler.takeError();
+        }
+        auto env = ks::CodeGenEnvironment::predefined_operators((*jit_compiler)->get_data_layout());
+        if (auto operators = env.add_to_jit_compiler(**jit_compiler); !operators)
+        {
+            return operators.takeError();
+        }
+        start = Clock::now();
+        for (const auto& fun : functions)
+        {
+            if (fun->codegen(env) == nullptr)
+            {
+                return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                               std::format("Failed to compile `{}`", fun->get_name()));
+            }
+        }
+        codegen.samples_ns.push_back(elapsed_ns(start));
+        codegen.items = functions.size();
+
+        start = Clock::now();
+        if (auto added = env.add_to_jit_compiler(**jit_compiler); !added)
+        {
+            return added.takeError();
+        }
+        add_to_jit.samples_ns.push_back(elapsed_ns(start));
+        add_to_jit.items = functions.size();
+
+        auto names = std::vector<std::string>();
+        for (const auto& fun : functions)
+        {
+            names.emplace_back(fun->get_name());
+        }
+        start = Clock::now();
+        auto symbols = (*jit_compiler)->lookup_all(names);
+        if (!symbols)
+        {
+            return symbols.takeError();
+        }
+        materialize.samples_ns.push_back(elapsed_ns(start));
+        materialize.items = names.size();
+
+        const auto entry = symbols->back().getAddress().toPtr<double (*)(double)>();
+        auto sink = 0.0;
+        start = Clock::now();
+        for (auto idx = std::uint64_t(0); idx < calls; ++idx)
+        {
+            sink += entry(static_cast<double>(idx));
+        }
+        call.samples_ns.push_back(elapsed_ns(start));
+        call.items = calls;
+        benchmark_sink = sink;
+    }
+    return stages;
+}
+
+void write_stage(llvm::json::OStream& json, const Program& program, Stage& stage)
+{
+    std::ranges::sort(stage.samples_ns);
+    const auto& samples = stage.samples_ns;
+    const auto median = samples[samples.size() / 2u];
+    const auto total = std::accumulate(samples.begin(), samples.end(), std::uint64_t(0));
+    json.object([&]() {
+        json.attribute("program", program.name);
+        json.attribute("size", static_cast<int64_t>(program.size));
+        json.attribute("stage", stage.name);
+        json.attribute("items", static_cast<int64_t>(stage.items));
+        json.attribute("repetitions", static_cast<int64_t>(samples.size()));
+        json.attribute("min_ns", static_cast<int64_t>(samples.front()));
+        json.attribute("median_ns", static_cast<int64_t>(median));
+        json.attribute("mean_ns", static_cast<double>(total) / static_cast<double>(samples.size()));
+        json.attribute("median_ns_per_item",
+                       stage.items == 0u ? 0.0 : static_cast<double>(median) / static_cast<double>(stage.items));
+    });
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto definitions = llvm::cl::opt<std::uint64_t>(
+        "definitions", llvm::cl::desc("Number of definitions in the `definitions` program"), llvm::cl::init(1000u));
+    auto depth = llvm::cl::opt<std::uint64_t>("depth", llvm::cl::desc("Nesting depth of the `nesting` program"),
+                                              llvm::cl::init(64u));
+    auto chain = llvm::cl::opt<std::uint64_t>(
+        "chain", llvm::cl::desc("Number of functions in the `call_chain` program"), llvm::cl::init(256u));
+    auto calls = llvm::cl::opt<std::uint64_t>("calls", llvm::cl::desc("Native calls of `entry` per repetition"),
+                                              llvm::cl::init(1000000u));
+    auto repetitions =
+        llvm::cl::opt<unsigned>("repetitions", llvm::cl::desc("Repetitions of each stage"), llvm::cl::init(5u));
+    auto output = llvm::cl::opt<std::string>("o", llvm::cl::desc("Write the JSON results to this file"),
+                                             llvm::cl::init("-"));
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope benchmarks\n");
+
+    if (repetitions == 0u || definitions == 0u || depth == 0u || chain == 0u)
+    {
+        std::cerr << "--repetitions, --definitions, --depth and --chain must be at least 1\n";
+        return 1;
+    }
+
+    auto ec = std::error_code();
+    auto out = llvm::raw_fd_ostream(output, ec, llvm::sys::fs::OF_Text);
+    if (ec)
+    {
+        std::cerr << std::format("Cannot open {}: {}\n", output.getValue(), ec.message());
+        return 1;
+    }
+
+    const auto programs = std::vector<Program>{many_definitions(definitions), deep_nesting(depth), call_chain(chain)};
+    auto json = llvm::json::OStream(out, 2);
+    auto ok = true;
+    json.object([&]() {
+        json.attributeArray("benchmarks", [&]() {
+            for (const auto& program : programs)
+            {
+                auto stages = run_program(program, repetitions, calls);
+                if (!stages)
+                {
+                    std::cerr << llvm::toString(stages.takeError()) << '\n';
+                    ok = false;
+                    continue;
+                }
+                for (auto& stage : *stages)
+                {
+                    write_stage(json, program, stage);
+                }
+            }
+        });
+    });
+    out << '\n';
+    return ok ? 0 : 1;
+}
@@ -1,19 +1,21 @@
 #include "ast.hpp"
 
 #include <algorithm>
+#include <array>
 #include <format>
 #include <iostream>
 #include <iterator>
 #include <map>
-#include <optional>
 #include <string>
 
 #if defined(__clang__)
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Weverything"
 #endif
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
@@ -23,6 +25,7 @@
 #endif
 
 #include "environment.hpp"
+#include "interpreter.hpp"
 
 namespace ks
 {
@@ -33,66 +36,334 @@ static llvm::Value* LogErrorV(const std::string_view str)
     return nullptr;
 }
 
-static std::optional<double> parse_number(const std::string& s)
+static std::optional<ArrayValue> LogErrorA(const std::string_view str)
 {
-    auto iss = std::istringstream(s);
-    auto d = double(0);
-    if (iss >> std::noskipws >> d && iss.eof())
-    {
-        return d;
-    }
-    else
-    {
-        return std::nullopt;
-    }
+    LogErrorV(str);
+    return std::nullopt;
+}
+
+/// Arrays only come from the host through compiled code; the interpreter has no array values.
+static std::optional<double> LogErrorCompiledOnly(const std::string_view form)
+{
+    std::cerr << std::format("`{}` is only supported in compiled code", form);
+    return std::nullopt;
+}
+
+std::optional<ArrayValue> ExprAST::codegen_array(CodeGenEnvironment&)
+{
+    return LogErrorA(std::format("Expected an array, found {}", this->to_string()));
+}
+
+llvm::Value* NumberExprAST::codegen(CodeGenEnvironment& env)
+{
+    return llvm::ConstantFP::get(*env.context, llvm::APFloat(this->value));
+}
+
+std::optional<double> NumberExprAST::evaluate(Interpreter&) const
+{
+    return this->value;
 }
 
 llvm::Value* VariableExprAST::codegen(CodeGenEnvironment& env)
 {
-    if (env.named_values.contains(this->name))
+    if (const auto v = env.named_values.find(this->name); v != nullptr && *v != nullptr)
     {
-        // variable
-        const auto v = env.named_values[this->name];
-        if (v != nullptr)
-        {
-            return v;
-        }
+        return *v;
     }
-    else if (auto d = parse_number(this->name); d.has_value())
+    if (is_array_name(this->name))
     {
-        // if not variable, it is a number
-        return llvm::ConstantFP::get(*env.context, llvm::APFloat(d.value()));
+        return LogErrorV(std::format("`{}` is an array, expected a number", this->name));
     }
 
     return LogErrorV(std::format("Unknown variable `{}`", this->name));
 }
 
+std::optional<ArrayValue> VariableExprAST::codegen_array(CodeGenEnvironment& env)
+{
+    if (const auto array = env.named_arrays.find(this->name))
+    {
+        return *array;
+    }
+    return LogErrorA(std::format("Unknown array `{}`", this->name));
+}
+
+std::optional<double> VariableExprAST::evaluate(Interpreter& interpreter) const
+{
+    return interpreter.lookup_variable(this->name);
+}
+
 llvm::Value* CallExprAST::codegen(CodeGenEnvironment& env)
 {
+    if (this->args.size() == 2u && CodeGenEnvironment::is_operator(this->callee))
+    {
+        const auto lhs = this->args[0]->codegen(env);
+        const auto rhs = this->args[1]->codegen(env);
+        if (lhs == nullptr || rhs == nullptr)
+        {
+            return nullptr;
+        }
+        return env.gen_operator(this->callee, lhs, rhs);
+    }
+
     auto callee_fun = env.get_function(this->callee);
     if (callee_fun == nullptr)
     {
         return LogErrorV(std::format("Unknown function `{}`", this->callee));
     }
 
-    if (callee_fun->arg_size() != this->args.size())
+    const auto proto = env.function_prototypes.find(this->callee);
+    if (proto == nullptr)
+    {
+        return LogErrorV(std::format("Unknown function `{}`", this->callee));
+    }
+    const auto& params = (*proto)->get_args();
+    if (params.size() != this->args.size())
     {
         return LogErrorV(std::format("function `{}` expects {} argments, passed {} argments", this->callee,
-                                     callee_fun->arg_size(), this->args.size()));
+                                     params.size(), this->args.size()));
     }
 
+    // An array argument is passed as its data pointer and its length.
     auto args_v = std::vector<llvm::Value*>();
-    args_v.reserve(this->args.size());
+    args_v.reserve(callee_fun->arg_size());
+    for (auto idx = std::size_t(0); idx < params.size(); ++idx)
+    {
+        if (is_array_name(params[idx]))
+        {
+            const auto array = this->args[idx]->codegen_array(env);
+            if (!array)
+            {
+                return nullptr;
+            }
+            args_v.push_back(array->data);
+            args_v.push_back(array->length);
+        }
+        else if (const auto arg = this->args[idx]->codegen(env))
+        {
+            args_v.push_back(arg);
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
 
-    std::ranges::transform(this->args, std::back_inserter(args_v), [&env](auto& arg) { return arg->codegen(env); });
+    return env.builder->CreateCall(callee_fun, args_v, "calltmp");
+}
 
-    if (std::ranges::any_of(args_v, [](auto p) { return p == nullptr; }))
+static bool evaluate_args(std::span<ExprAST* const> args, Interpreter& interpreter,
+                          llvm::SmallVectorImpl<double>& values)
+{
+    values.reserve(args.size());
+    for (const auto arg : args)
+    {
+        const auto value = arg->evaluate(interpreter);
+        if (!value)
+        {
+            return false;
+        }
+        values.push_back(*value);
+    }
+    return true;
+}
+
+std::optional<double> CallExprAST::evaluate(Interpreter& interpreter) const
+{
+    auto args_v = llvm::SmallVector<double, 8>();
+    if (!evaluate_args(this->args, interpreter, args_v))
+    {
+        return std::nullopt;
+    }
+    return interpreter.call(this->callee, args_v);
+}
+
+std::optional<double> CallExprAST::evaluate_tail(Interpreter& interpreter) const
+{
+    auto args_v = llvm::SmallVector<double, 8>();
+    if (!evaluate_args(this->args, interpreter, args_v))
+    {
+        return std::nullopt;
+    }
+    return interpreter.request_tail_call(this->callee, args_v);
+}
+
+llvm::Value* IfExprAST::codegen(CodeGenEnvironment& env)
+{
+    auto cond_v = this->cond->codegen(env);
+    if (cond_v == nullptr)
     {
         return nullptr;
     }
+    cond_v = env.builder->CreateFCmpONE(cond_v, llvm::ConstantFP::get(*env.context, llvm::APFloat(0.0)), "ifcond");
 
-    return env.builder->CreateCall(callee_fun, args_v, "calltmp");
+    // All blocks are attached right away, so nothing leaks if a branch fails to generate.
+    const auto fun = env.builder->GetInsertBlock()->getParent();
+    auto then_bb = llvm::BasicBlock::Create(*env.context, "then", fun);
+    auto else_bb = llvm::BasicBlock::Create(*env.context, "else", fun);
+    const auto merge_bb = llvm::BasicBlock::Create(*env.context, "ifcont", fun);
+    env.builder->CreateCondBr(cond_v, then_bb, else_bb);
+
+    env.builder->SetInsertPoint(then_bb);
+    const auto then_v = this->then->codegen(env);
+    if (then_v == nullptr)
+    {
+        return nullptr;
+    }
+    env.builder->CreateBr(merge_bb);
+    // Nested control flow may have moved the end of the branch to another block.
+    then_bb = env.builder->GetInsertBlock();
+
+    env.builder->SetInsertPoint(else_bb);
+    const auto else_v = this->otherwise->codegen(env);
+    if (else_v == nullptr)
+    {
+        return nullptr;
+    }
+    env.builder->CreateBr(merge_bb);
+    else_bb = env.builder->GetInsertBlock();
+
+    env.builder->SetInsertPoint(merge_bb);
+    const auto phi = env.builder->CreatePHI(llvm::Type::getDoubleTy(*env.context), 2, "iftmp");
+    phi->addIncoming(then_v, then_bb);
+    phi->addIncoming(else_v, else_bb);
+    return phi;
+}
+
+llvm::Value* LenExprAST::codegen(CodeGenEnvironment& env)
+{
+    const auto array = this->array->codegen_array(env);
+    if (!array)
+    {
+        return nullptr;
+    }
+    return env.builder->CreateSIToFP(array->length, llvm::Type::getDoubleTy(*env.context), "len");
+}
+
+std::optional<double> LenExprAST::evaluate(Interpreter&) const
+{
+    return LogErrorCompiledOnly("len");
 }
+
+llvm::Value* MapExprAST::codegen(CodeGenEnvironment& env)
+{
+    auto inputs_v = llvm::SmallVector<ArrayValue, 2>();
+    for (const auto input : this->inputs)
+    {
+        const auto array = input->codegen_array(env);
+        if (!array)
+        {
+            return nullptr;
+        }
+        inputs_v.push_back(*array);
+    }
+    const auto output_v = this->output->codegen_array(env);
+    if (!output_v)
+    {
+        return nullptr;
+    }
+
+    auto count = output_v->length;
+    for (const auto& input : inputs_v)
+    {
+        count = env.builder->CreateBinaryIntrinsic(llvm::Intrinsic::smin, count, input.length);
+    }
+
+    const auto double_ty = llvm::Type::getDoubleTy(*env.context);
+    // Nothing is accumulated; the loop only stores.
+    const auto unused = llvm::ConstantFP::get(double_ty, 0.0);
+    const auto stored = env.gen_loop(count, unused, [&](llvm::Value* index, llvm::Value* acc) -> llvm::Value* {
+        auto operands = llvm::SmallVector<llvm::Value*, 2>();
+        for (const auto& input : inputs_v)
+        {
+            const auto element = env.builder->CreateInBoundsGEP(double_ty, input.data, index, "element.ptr");
+            operands.push_back(env.builder->CreateLoad(double_ty, element, "element"));
+        }
+        const auto result = env.gen_apply(this->fun, operands);
+        if (result == nullptr)
+        {
+            return nullptr;
+        }
+        env.builder->CreateStore(result, env.builder->CreateInBoundsGEP(double_ty, output_v->data, index, "out.ptr"));
+        return acc;
+    });
+    if (stored == nullptr)
+    {
+        return nullptr;
+    }
+    return env.builder->CreateSIToFP(count, double_ty, "count");
+}
+
+std::optional<double> MapExprAST::evaluate(Interpreter&) const
+{
+    return LogErrorCompiledOnly(this->inputs.size() == 1u ? "map" : "zip");
+}
+
+llvm::Value* ReduceExprAST::codegen(CodeGenEnvironment& env)
+{
+    const auto init_v = this->init->codegen(env);
+    if (init_v == nullptr)
+    {
+        return nullptr;
+    }
+    const auto array_v = this->array->codegen_array(env);
+    if (!array_v)
+    {
+        return nullptr;
+    }
+
+    // Without reassociation, the loop vectorizer cannot split a floating-point reduction into SIMD lanes. Only sums
+    // and products are reassociated; any other operator or function keeps the exact left-to-right order.
+    static const auto add = Symbol::intern("+");
+    static const auto mul = Symbol::intern("*");
+    const auto guard = llvm::IRBuilderBase::FastMathFlagGuard(*env.builder);
+    auto flags = llvm::FastMathFlags();
+    flags.setAllowReassoc(this->fun == add || this->fun == mul);
+    env.builder->setFastMathFlags(flags);
+
+    const auto double_ty = llvm::Type::getDoubleTy(*env.context);
+    return env.gen_loop(array_v->length, init_v, [&](llvm::Value* index, llvm::Value* acc) {
+        const auto element = env.builder->CreateInBoundsGEP(double_ty, array_v->data, index, "element.ptr");
+        const auto operands = std::array<llvm::Value*, 2>{acc, env.builder->CreateLoad(double_ty, element, "element")};
+        return env.gen_apply(this->fun, operands);
+    });
+}
+
+std::optional<double> ReduceExprAST::evaluate(Interpreter&) const
+{
+    return LogErrorCompiledOnly("reduce");
+}
+
+std::optional<bool> IfExprAST::evaluate_condition(Interpreter& interpreter) const
+{
+    const auto cond_v = this->cond->evaluate(interpreter);
+    if (!cond_v)
+    {
+        return std::nullopt;
+    }
+    // `fcmp one`: false for NaN, like the compiled code.
+    return *cond_v < 0.0 || *cond_v > 0.0;
+}
+
+std::optional<double> IfExprAST::evaluate(Interpreter& interpreter) const
+{
+    const auto cond_v = this->evaluate_condition(interpreter);
+    if (!cond_v)
+    {
+        return std::nullopt;
+    }
+    return *cond_v ? this->then->evaluate(interpreter) : this->otherwise->evaluate(interpreter);
+}
+
+std::optional<double> IfExprAST::evaluate_tail(Interpreter& interpreter) const
+{
+    const auto cond_v = this->evaluate_condition(interpreter);
+    if (!cond_v)
+    {
+        return std::nullopt;
+    }
+    return *cond_v ? this->then->evaluate_tail(interpreter) : this->otherwise->evaluate_tail(interpreter);
+}
+
 llvm::Function* PrototypeAST::codegen(CodeGenEnvironment& env)
 {
     return env.gen_prototype(this->name, this->args);
@@ -104,4 +375,14 @@ llvm::Function* FunctionAST::codegen(CodeGenEnvironment& env)
                                       [this](auto& e) { return this->body->codegen(e); });
     return fun;
 }
+
+std::optional<double> FunctionAST::evaluate(Interpreter& interpreter) const
+{
+    return this->body->evaluate(interpreter);
+}
+
+std::optional<double> FunctionAST::evaluate_tail(Interpreter& interpreter) const
+{
+    return this->body->evaluate_tail(interpreter);
+}
 } // namespace ks
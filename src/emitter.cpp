@@ -0,0 +1,170 @@
+#include "emitter.hpp"
+
+#include <algorithm>
+#include <array>
+#include <format>
+#include <set>
+#include <string>
+#include <string_view>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Object/Archive.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Host.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+/// Whether C code can refer to `name`: an identifier that is neither a keyword of C or C++ nor a type the generated
+/// header uses.
+static bool is_c_identifier(const std::string_view name)
+{
+    static constexpr auto reserved = std::to_array<std::string_view>(
+        {"_Bool", "_Complex", "alignas", "alignof", "auto", "bool", "break", "case", "char", "class", "const",
+         "continue", "default", "delete", "do", "double", "else", "enum", "extern", "false", "float", "for", "goto",
+         "if", "inline", "int", "int64_t", "long", "namespace", "new", "nullptr", "operator", "register", "restrict",
+         "return", "short", "signed", "sizeof", "static", "static_assert", "struct", "switch", "template", "this",
+         "thread_local", "true", "typedef", "typename", "typeof", "union", "unsigned", "using", "virtual", "void",
+         "volatile", "while"});
+    const auto is_alpha = [](char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_'; };
+    const auto is_alnum = [&is_alpha](char c) { return is_alpha(c) || ('0' <= c && c <= '9'); };
+    return !name.empty() && is_alpha(name.front()) && std::ranges::all_of(name, is_alnum) &&
+           std::ranges::find(reserved, name) == reserved.end();
+}
+
+static llvm::Error write_buffer(llvm::StringRef path, llvm::StringRef contents)
+{
+    return llvm::writeToOutput(path, [contents](llvm::raw_ostream& os) {
+        os << contents;
+        return llvm::Error::success();
+    });
+}
+
+llvm::Expected<ObjectEmitter> ObjectEmitter::create(const llvm::CodeGenOptLevel codegen_opt_level)
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    auto builder = llvm::orc::JITTargetMachineBuilder(llvm::Triple(llvm::sys::getDefaultTargetTriple()));
+    builder.setRelocationModel(llvm::Reloc::PIC_);
+    builder.setCodeGenOptLevel(codegen_opt_level);
+    auto target_machine = builder.createTargetMachine();
+    if (!target_machine)
+    {
+        return target_machine.takeError();
+    }
+    return ObjectEmitter(std::move(builder), std::move(*target_machine));
+}
+
+llvm::Expected<llvm::SmallVector<char, 0>> ObjectEmitter::emit_object(llvm::Module& module, const bool internalize)
+{
+    module.setTargetTriple(this->target_machine->getTargetTriple().str());
+    module.setDataLayout(this->target_machine->createDataLayout());
+    for (auto& fun : module)
+    {
+        if (internalize && !fun.isDeclaration() && !is_c_identifier(fun.getName()))
+        {
+            fun.setLinkage(llvm::GlobalValue::InternalLinkage);
+        }
+    }
+
+    auto object = llvm::SmallVector<char, 0>();
+    auto os = llvm::raw_svector_ostream(object);
+    auto pass_manager = llvm::legacy::PassManager();
+    if (this->target_machine->addPassesToEmitFile(pass_manager, os, nullptr, llvm::CodeGenFileType::ObjectFile))
+    {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "The target cannot emit object files");
+    }
+    pass_manager.run(module);
+    return object;
+}
+
+llvm::Error ObjectEmitter::write_object(llvm::ArrayRef<char> object, llvm::StringRef path)
+{
+    return write_buffer(path, llvm::StringRef(object.data(), object.size()));
+}
+
+llvm::Error ObjectEmitter::write_static_library(llvm::ArrayRef<char> object, llvm::StringRef path) const
+{
+    const auto member_name = std::format("{}.o", llvm::sys::path::stem(path).str());
+    const auto member = llvm::NewArchiveMember(
+        llvm::MemoryBufferRef(llvm::StringRef(object.data(), object.size()), member_name));
+
+    const auto& triple = this->target_machine->getTargetTriple();
+    const auto kind = triple.isOSDarwin()        ? llvm::object::Archive::K_DARWIN
+                      : triple.isOSBinFormatCOFF() ? llvm::object::Archive::K_COFF
+                                                   : llvm::object::Archive::K_GNU;
+    return llvm::writeArchive(path, llvm::ArrayRef(member), llvm::SymtabWritingMode::NormalSymtab, kind,
+                              /*Deterministic=*/true, /*Thin=*/false);
+}
+
+llvm::Error ObjectEmitter::write_c_header(const llvm::Module& module,
+                                          const SymbolMap<std::unique_ptr<PrototypeAST>>& prototypes,
+                                          llvm::StringRef path)
+{
+    const auto declare = [](const PrototypeAST& proto) {
+        // A parameter keeps its own name where C allows it; `x_len` or a renamed `arg0` may still be taken by
+        // another one, so every name is made unique.
+        auto used = std::set<std::string>();
+        const auto unique = [&used](std::string name) {
+            while (!used.insert(name).second)
+            {
+                name += '_';
+            }
+            return name;
+        };
+        auto params = std::string();
+        auto idx = std::size_t(0);
+        for (const auto arg : proto.get_args())
+        {
+            const auto is_array = is_array_name(arg);
+            const auto base = is_array ? arg.str().substr(0u, arg.str().size() - 2u) : arg.str();
+            const auto name = unique(is_c_identifier(base) ? std::string(base) : std::format("arg{}", idx));
+            const auto separator = idx++ == 0u ? "" : ", ";
+            params += is_array ? std::format("{}double* {}, int64_t {}", separator, name, unique(name + "_len"))
+                               : std::format("{}double {}", separator, name);
+        }
+        return std::format("double {}({});\n", proto.get_name(), params.empty() ? "void" : params);
+    };
+
+    auto defined = std::string();
+    auto external = std::string();
+    for (const auto name : prototypes.get_keys())
+    {
+        const auto& proto = **prototypes.find(name);
+        if (!is_c_identifier(name.str()) || name.str().starts_with("__annon_expr"))
+        {
+            continue;
+        }
+        const auto fun = module.getFunction(name.str());
+        (fun != nullptr && !fun->isDeclaration() ? defined : external) += declare(proto);
+    }
+
+    auto header = std::string("/* Generated by kaleidoscope. Do not edit. */\n"
+                              "#pragma once\n\n"
+                              "#include <stdint.h>\n\n"
+                              "#ifdef __cplusplus\n"
+                              "extern \"C\" {\n"
+                              "#endif\n\n");
+    header += defined;
+    if (!external.empty())
+    {
+        header += std::format("\n/* Provided by the host. */\n{}", external);
+    }
+    header += "\n#ifdef __cplusplus\n"
+              "}\n"
+              "#endif\n";
+    return write_buffer(path, header);
+}
+} // namespace ks
@@ -0,0 +1,390 @@
+#include "engine.hpp"
+
+#include <algorithm>
+#include <format>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <variant>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "ast.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+
+namespace ks
+{
+
+namespace
+{
+llvm::Error make_error(const std::string& message)
+{
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), message);
+}
+
+/// The pipeline for `opt_level`, or the default per-function passes without a level.
+llvm::Expected<std::unique_ptr<OptimizationPipeline>> create_optimizer(JITCompiler& jit_compiler,
+                                                                       const std::optional<OptLevel>& opt_level)
+{
+    if (!opt_level)
+    {
+        return nullptr;
+    }
+    auto target_machine = jit_compiler.create_target_machine();
+    if (!target_machine)
+    {
+        return target_machine.takeError();
+    }
+    return std::make_unique<OptimizationPipeline>(opt_level->ir, std::move(*target_machine));
+}
+} // namespace
+
+void FunctionRegistry::import(std::size_t& seen, SymbolMap<std::unique_ptr<PrototypeAST>>& into) const
+{
+    const auto lock = std::shared_lock(this->mutex);
+    const auto& keys = this->prototypes.get_keys();
+    for (; seen < keys.size(); ++seen)
+    {
+        if (!into.contains(keys[seen]))
+        {
+            into[keys[seen]] = std::make_unique<PrototypeAST>(**this->prototypes.find(keys[seen]));
+        }
+    }
+}
+
+std::optional<PrototypeAST> FunctionRegistry::find(const Symbol name) const
+{
+    const auto lock = std::shared_lock(this->mutex);
+    if (const auto proto = this->prototypes.find(name))
+    {
+        return **proto;
+    }
+    return std::nullopt;
+}
+
+bool FunctionRegistry::is_defined(const Symbol name) const
+{
+    const auto lock = std::shared_lock(this->mutex);
+    return this->defined.contains(name);
+}
+
+std::optional<Symbol> FunctionRegistry::claim(const std::span<const Symbol> definitions,
+                                              const SymbolMap<std::unique_ptr<PrototypeAST>>& declared)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    const auto taken = std::ranges::find_if(definitions, [this, &declared](const Symbol name) {
+        if (this->defined.contains(name))
+        {
+            return true;
+        }
+        const auto published = this->prototypes.find(name);
+        const auto proto = declared.find(name);
+        return published != nullptr && proto != nullptr && !(*published)->has_same_parameters(**proto);
+    });
+    if (taken != definitions.end())
+    {
+        return *taken;
+    }
+    this->defined.insert(definitions.begin(), definitions.end());
+    return std::nullopt;
+}
+
+void FunctionRegistry::release(const std::span<const Symbol> definitions)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    for (const auto name : definitions)
+    {
+        this->defined.erase(name);
+    }
+}
+
+void FunctionRegistry::publish(const std::span<const Symbol> declarations, const std::span<const Symbol> definitions,
+                               const SymbolMap<std::unique_ptr<PrototypeAST>>& declared)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    for (const auto names : {declarations, definitions})
+    {
+        for (const auto name : names)
+        {
+            // Batch entry points are not callable from source and have no prototype.
+            const auto proto = declared.find(name);
+            if (proto != nullptr && !this->prototypes.contains(name))
+            {
+                this->prototypes[name] = std::make_unique<PrototypeAST>(**proto);
+            }
+        }
+    }
+}
+
+Session::Session(Engine& _engine, CodeGenEnvironment _env) : engine(_engine), env(std::move(_env))
+{
+}
+
+Engine::Engine(std::unique_ptr<JITCompiler> _jit_compiler, CodeGenEnvironment _env, const EngineOptions& _options)
+    : jit_compiler(std::move(_jit_compiler)), opt_level(_options.opt_level), statistics(_options.jit.statistics),
+      session(*this, std::move(_env))
+{
+    // Publishes the operators as definitions, so that other sessions import them too and no session redefines them.
+    const auto& operators = this->session.get_environment().function_prototypes;
+    std::ignore = this->registry.claim(operators.get_keys(), operators);
+    this->registry.publish({}, operators.get_keys(), operators);
+}
+
+llvm::Expected<std::unique_ptr<Engine>> Engine::create(const EngineOptions& options)
+{
+    auto jit_options = options.jit;
+    if (options.opt_level)
+    {
+        jit_options.codegen_opt_level = options.opt_level->codegen;
+    }
+    auto jit_compiler = JITCompiler::create(jit_options);
+    if (!jit_compiler)
+    {
+        return jit_compiler.takeError();
+    }
+
+    auto optimizer = create_optimizer(**jit_compiler, options.opt_level);
+    if (!optimizer)
+    {
+        return optimizer.takeError();
+    }
+    const auto lazy = (*jit_compiler)->is_lazy();
+    if (lazy)
+    {
+        (*jit_compiler)->optimize_lazily([&jit = **jit_compiler, opt_level = options.opt_level,
+                                          statistics = jit_options.statistics]() {
+            auto lazy_optimizer = create_optimizer(jit, opt_level);
+            if (lazy_optimizer)
+            {
+                if (*lazy_optimizer == nullptr)
+                {
+                    *lazy_optimizer = std::make_unique<OptimizationPipeline>();
+                }
+                (*lazy_optimizer)->set_statistics(statistics);
+            }
+            return lazy_optimizer;
+        });
+    }
+    const auto& layout = (*jit_compiler)->get_data_layout();
+    if (options.prelude_object.empty())
+    {
+        auto env = CodeGenEnvironment::predefined_operators(layout, std::move(*optimizer));
+        env.optimizer->set_statistics(jit_options.statistics);
+        env.defer_optimization = lazy;
+        if (auto operators = env.add_to_jit_compiler(**jit_compiler); !operators)
+        {
+            return operators.takeError();
+        }
+        return std::make_unique<Engine>(std::move(*jit_compiler), std::move(env), options);
+    }
+
+    auto prelude = llvm::MemoryBuffer::getMemBuffer(
+        llvm::StringRef(options.prelude_object.data(), options.prelude_object.size()), "<prelude>",
+        /*RequiresNullTerminator=*/false);
+    if (auto err = (*jit_compiler)->add_object(std::move(prelude)))
+    {
+        return std::move(err);
+    }
+    auto env = CodeGenEnvironment::declared_operators(layout, std::move(*optimizer));
+    env.optimizer->set_statistics(jit_options.statistics);
+    env.defer_optimization = lazy;
+    return std::make_unique<Engine>(std::move(*jit_compiler), std::move(env), options);
+}
+
+llvm::Expected<std::unique_ptr<Session>> Engine::create_session()
+{
+    auto optimizer = create_optimizer(*this->jit_compiler, this->opt_level);
+    if (!optimizer)
+    {
+        return optimizer.takeError();
+    }
+    auto env = CodeGenEnvironment(this->jit_compiler->get_data_layout(), std::move(*optimizer));
+    env.optimizer->set_statistics(this->statistics);
+    env.defer_optimization = this->jit_compiler->is_lazy();
+    return std::make_unique<Session>(*this, std::move(env));
+}
+
+llvm::Expected<std::vector<double>> Session::compile(const std::string_view source)
+{
+    // The lexer works on `source` in place; the ASTs only keep interned symbols, so nothing refers to it afterwards.
+    auto buffer = llvm::MemoryBuffer::getMemBuffer(llvm::StringRef(source.data(), source.size()), "<source>",
+                                                   /*RequiresNullTerminator=*/false);
+    auto parser = Parser(Lexer(std::move(buffer)), /*_echo=*/false);
+    auto& registry = this->engine.registry;
+    registry.import(this->imported, this->env.function_prototypes);
+    for (const auto name : this->env.function_prototypes.get_keys())
+    {
+        parser.declare_function(name);
+    }
+    auto declarations = std::vector<Symbol>();
+    auto definitions = std::vector<Symbol>();
+    auto top_level_expressions = std::vector<std::unique_ptr<FunctionAST>>();
+    while (auto result = parser.parse_top_level())
+    {
+        auto form = std::move(*result);
+        if (const auto proto = std::get_if<std::unique_ptr<PrototypeAST>>(&form))
+        {
+            if ((*proto)->codegen(this->env) == nullptr)
+            {
+                this->discard_module(definitions);
+                return make_error(std::format("Failed to declare `{}`", (*proto)->get_name()));
+            }
+            declarations.push_back((*proto)->get_name());
+            continue;
+        }
+
+        auto& fun = std::get<std::unique_ptr<FunctionAST>>(form);
+        if (fun->is_top_level_expression())
+        {
+            top_level_expressions.push_back(std::move(fun));
+            continue;
+        }
+        const auto name = fun->get_prototype().get_name();
+        if (registry.is_defined(name) || std::ranges::find(definitions, name) != definitions.end())
+        {
+            this->discard_module(definitions);
+            return make_error(std::format("Function `{}` cannot be redefined", name));
+        }
+        if (fun->codegen(this->env) == nullptr)
+        {
+            this->discard_module(definitions);
+            return make_error(std::format("Failed to compile `{}`", name));
+        }
+        definitions.push_back(name);
+        if (!fun->get_prototype().takes_arrays())
+        {
+            // Generated right after `fun`, so that its body is inlined into the loop.
+            const auto batch_name = Symbol::intern(std::format("{}_batch", name));
+            if (!registry.is_defined(batch_name) && !this->env.function_prototypes.contains(batch_name))
+            {
+                if (this->env.gen_batch_function(name) == nullptr)
+                {
+                    this->discard_module(definitions);
+                    return make_error(std::format("Failed to generate the batch entry point of `{}`", name));
+                }
+                definitions.push_back(batch_name);
+            }
+        }
+        this->env.retain_for_inlining(std::move(fun));
+    }
+    if (!parser.reached_end_of_input())
+    {
+        this->discard_module(definitions);
+        return make_error("Failed to parse the source");
+    }
+
+    // Another session may have defined or declared one of these names since it was checked above.
+    if (const auto taken = registry.claim(definitions, this->env.function_prototypes))
+    {
+        this->discard_module(definitions);
+        if (!registry.is_defined(*taken))
+        {
+            return make_error(std::format("Function `{}` is defined with other parameters than it was declared with",
+                                          *taken));
+        }
+        return make_error(std::format("Function `{}` cannot be redefined", *taken));
+    }
+    if (auto added = this->env.add_to_jit_compiler(this->engine.get_jit_compiler()); !added)
+    {
+        registry.release(definitions);
+        this->discard_module(definitions);
+        return added.takeError();
+    }
+    registry.publish(declarations, definitions, this->env.function_prototypes);
+
+    // Each expression gets its own module, removed again once it has run.
+    auto values = std::vector<double>();
+    values.reserve(top_level_expressions.size());
+    for (const auto& expr : top_level_expressions)
+    {
+        const auto fun = expr->codegen(this->env);
+        if (fun == nullptr)
+        {
+            this->discard_module({});
+            return make_error("Failed to compile a top-level expression");
+        }
+        // Each parser numbers its expressions from zero, so concurrent sessions would define the same names.
+        const auto name = std::format("__annon_expr{}", this->engine.expressions++);
+        fun->setName(name);
+        auto resource_tracker = this->env.add_to_jit_compiler(this->engine.get_jit_compiler(), true);
+        if (!resource_tracker)
+        {
+            return resource_tracker.takeError();
+        }
+        auto symbol = this->engine.get_jit_compiler().lookup(name);
+        if (!symbol)
+        {
+            return llvm::joinErrors(symbol.takeError(), (*resource_tracker)->remove());
+        }
+        values.push_back(symbol->getAddress().toPtr<double (*)()>()());
+        if (auto err = (*resource_tracker)->remove())
+        {
+            return err;
+        }
+    }
+    return values;
+}
+
+llvm::Expected<llvm::orc::ExecutorAddr> Engine::lookup_address(const std::string_view name,
+                                                               const std::string_view parameters)
+{
+    const auto proto = this->registry.find(Symbol::intern(name));
+    if (!proto)
+    {
+        return make_error(std::format("Function `{}` not found", name));
+    }
+    auto expected = std::string();
+    for (const auto arg : proto->get_args())
+    {
+        expected += is_array_name(arg) ? "pn" : "d";
+    }
+    if (expected != parameters)
+    {
+        return make_error(std::format("`{}` is looked up with a different signature than it was defined with", name));
+    }
+
+    auto symbol = this->jit_compiler->lookup(llvm::StringRef(name.data(), name.size()));
+    if (!symbol)
+    {
+        return symbol.takeError();
+    }
+    return symbol->getAddress();
+}
+
+llvm::Expected<Engine::BatchFunction> Engine::lookup_batch(const std::string_view name)
+{
+    const auto proto = this->registry.find(Symbol::intern(name));
+    const auto batch_name = std::format("{}_batch", name);
+    if (!proto || proto->takes_arrays() || !this->registry.is_defined(Symbol::intern(batch_name)))
+    {
+        return make_error(std::format("`{}` has no batch entry point", name));
+    }
+
+    auto symbol = this->jit_compiler->lookup(batch_name);
+    if (!symbol)
+    {
+        return symbol.takeError();
+    }
+    return symbol->getAddress().toPtr<BatchFunction>();
+}
+
+void Session::discard_module(const std::vector<Symbol>& definitions)
+{
+    for (const auto name : definitions)
+    {
+        this->env.function_prototypes.erase(name);
+        this->env.inlinable_functions.erase(name);
+    }
+    this->env.optimizer->reset();
+    this->env.initialize_module(this->engine.get_jit_compiler().get_data_layout());
+}
+} // namespace ks
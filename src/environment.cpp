@@ -2,126 +2,404 @@
 
 #include <llvm/ExecutionEngine/Orc/Core.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <algorithm>
 #include <memory>
-
-#if defined(__clang__)
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Weverything"
-#elif defined(__GNUC__)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-#endif
-#include "llvm/Passes/PassBuilder.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Scalar/Reassociate.h"
-#include "llvm/Transforms/Scalar/SimplifyCFG.h"
-#if defined(__clang__)
-#pragma clang diagnostic pop
-#elif defined(__GNUC__)
-#pragma GCC diagnostic pop
-#endif
+#include <string_view>
+#include <vector>
 
 namespace ks
 {
 
-CodeGenEnvironment::CodeGenEnvironment(llvm::DataLayout layout)
+namespace
+{
+struct Operators
+{
+    Symbol add = Symbol::intern("+");
+    Symbol sub = Symbol::intern("-");
+    Symbol mul = Symbol::intern("*");
+    Symbol div = Symbol::intern("/");
+    Symbol less = Symbol::intern("<");
+};
+
+const Operators& operators()
 {
-    this->initialize_module_and_managers(layout);
+    static const auto ops = Operators();
+    return ops;
 }
+} // namespace
 
-CodeGenEnvironment CodeGenEnvironment::predefined_operators(llvm::DataLayout layout)
+CodeGenEnvironment::CodeGenEnvironment(llvm::DataLayout layout, std::unique_ptr<OptimizationPipeline> _optimizer)
+    : optimizer(_optimizer ? std::move(_optimizer) : std::make_unique<OptimizationPipeline>())
 {
-    CodeGenEnvironment env = CodeGenEnvironment(layout);
+    this->initialize_module(layout);
+}
+
+CodeGenEnvironment CodeGenEnvironment::predefined_operators(llvm::DataLayout layout,
+                                                            std::unique_ptr<OptimizationPipeline> optimizer)
+{
+    CodeGenEnvironment env = CodeGenEnvironment(layout, std::move(optimizer));
     env.register_operators();
     return env;
 }
 
-void CodeGenEnvironment::initialize_module_and_managers(llvm::DataLayout layout)
+CodeGenEnvironment CodeGenEnvironment::declared_operators(llvm::DataLayout layout,
+                                                          std::unique_ptr<OptimizationPipeline> optimizer)
+{
+    CodeGenEnvironment env = CodeGenEnvironment(layout, std::move(optimizer));
+    env.declare_operators();
+    return env;
+}
+
+void CodeGenEnvironment::initialize_module(llvm::DataLayout layout)
 {
     this->context = std::make_unique<llvm::LLVMContext>();
     this->builder = std::make_unique<llvm::IRBuilder<>>(*this->context);
     this->module = std::make_unique<llvm::Module>("my cool jit", *this->context);
     this->module->setDataLayout(layout);
-
-    this->function_pass_manager = std::make_unique<llvm::FunctionPassManager>();
-    this->loop_analysis_manager = std::make_unique<llvm::LoopAnalysisManager>();
-    this->function_analysis_manager = std::make_unique<llvm::FunctionAnalysisManager>();
-    this->cgscc_analysis_manager = std::make_unique<llvm::CGSCCAnalysisManager>();
-    this->module_analysis_manager = std::make_unique<llvm::ModuleAnalysisManager>();
-    this->pass_instrumentation_callbacks = std::make_unique<llvm::PassInstrumentationCallbacks>();
-    this->standard_instrumentations = std::make_unique<llvm::StandardInstrumentations>(*this->context, true);
-
-    this->standard_instrumentations->registerCallbacks(*this->pass_instrumentation_callbacks,
-                                                       this->module_analysis_manager.get());
-
-    this->function_pass_manager->addPass(llvm::InstCombinePass());
-    this->function_pass_manager->addPass(llvm::ReassociatePass());
-    this->function_pass_manager->addPass(llvm::GVNPass());
-    this->function_pass_manager->addPass(llvm::SimplifyCFGPass());
-
-    auto pass_builder = llvm::PassBuilder();
-    pass_builder.registerModuleAnalyses(*this->module_analysis_manager);
-    pass_builder.registerFunctionAnalyses(*this->function_analysis_manager);
-    pass_builder.crossRegisterProxies(*this->loop_analysis_manager, *this->function_analysis_manager,
-                                      *this->cgscc_analysis_manager, *this->module_analysis_manager);
+    if (const auto target_machine = this->optimizer->get_target_machine())
+    {
+        // Lets the optimizer know which library calls the target provides.
+        this->module->setTargetTriple(target_machine->getTargetTriple().str());
+    }
 }
 
-llvm::orc::ResourceTrackerSP CodeGenEnvironment::add_to_jit_compiler(JITCompiler& jit_compiler, bool resource_tracking)
+llvm::Expected<llvm::orc::ResourceTrackerSP> CodeGenEnvironment::add_to_jit_compiler(JITCompiler& jit_compiler,
+                                                                                    bool resource_tracking)
 {
-    static auto exit_on_error = llvm::ExitOnError();
     auto resource_tracker = resource_tracking ? jit_compiler.get_main_jit_dylib().createResourceTracker() : nullptr;
+    if (auto err = jit_compiler.add_module(this->take_module(jit_compiler.get_data_layout()), resource_tracker))
+    {
+        return std::move(err);
+    }
+    return resource_tracker;
+}
+
+llvm::orc::ThreadSafeModule CodeGenEnvironment::take_module(llvm::DataLayout layout)
+{
+    this->finalize_module();
     auto thread_safe_module = llvm::orc::ThreadSafeModule(std::move(this->module), std::move(this->context));
-    exit_on_error(jit_compiler.add_module(std::move(thread_safe_module), resource_tracker));
-    this->initialize_module_and_managers(jit_compiler.get_data_layout());
+    this->initialize_module(layout);
+    return thread_safe_module;
+}
 
-    return resource_tracker;
+void CodeGenEnvironment::finalize_module()
+{
+    const auto imported = this->import_inlinable_functions();
+    if (this->defer_optimization)
+    {
+        // The JIT optimizes each function once it is compiled, but by then the copies are gone, so they are inlined
+        // here already.
+        if (imported)
+        {
+            this->optimizer->run_inliner(*this->module);
+        }
+    }
+    else if (imported || this->optimizer->has_module_pipeline())
+    {
+        this->optimizer->run(*this->module);
+    }
+    if (imported)
+    {
+        // Calls that were not inlined link against the earlier definitions, so the copies can go before any layer
+        // has to deal with them.
+        for (auto& fun : *this->module)
+        {
+            if (fun.hasAvailableExternallyLinkage())
+            {
+                fun.deleteBody();
+            }
+        }
+    }
+    this->optimizer->reset();
 }
 
-llvm::Function* CodeGenEnvironment::get_function(const std::string_view name)
+llvm::Function* CodeGenEnvironment::get_function(const Symbol name)
 {
-    if (const auto fun = this->module->getFunction(name))
+    if (const auto fun = this->module->getFunction(name.str()))
     {
         return fun;
     }
-    const auto fi = this->function_prototypes.find(std::string(name));
-    if (fi != this->function_prototypes.end())
+    if (const auto proto = this->function_prototypes.find(name))
     {
-        return fi->second->codegen(*this);
+        return (*proto)->codegen(*this);
     }
 
     LogError(std::format("Function `{}` not found.", name));
     return nullptr;
 }
 
-void CodeGenEnvironment::register_operators()
+bool CodeGenEnvironment::is_operator(const Symbol name)
 {
-    constexpr auto args = std::array<std::string_view, 2>{"x", "y"};
-    std::ignore = this->gen_function("+", args, [&args](auto& env) {
-        const auto lhs = env.named_values[std::string(args[0])];
-        const auto rhs = env.named_values[std::string(args[1])];
-        return env.builder->CreateFAdd(lhs, rhs, "addtmp");
-    });
-    std::ignore = this->gen_function("-", args, [&args](auto& env) {
-        const auto lhs = env.named_values[std::string(args[0])];
-        const auto rhs = env.named_values[std::string(args[1])];
-        return env.builder->CreateFSub(lhs, rhs, "subtmp");
-    });
-    std::ignore = this->gen_function("*", args, [&args](auto& env) {
-        const auto lhs = env.named_values[std::string(args[0])];
-        const auto rhs = env.named_values[std::string(args[1])];
-        return env.builder->CreateFMul(lhs, rhs, "multmp");
-    });
-    std::ignore = this->gen_function("/", args, [&args](auto& env) {
-        const auto lhs = env.named_values[std::string(args[0])];
-        const auto rhs = env.named_values[std::string(args[1])];
-        return env.builder->CreateFDiv(lhs, rhs, "divtmp");
-    });
-    std::ignore = this->gen_function("<", args, [&args](auto& env) {
-        const auto lhs = env.named_values[std::string(args[0])];
-        const auto rhs = env.named_values[std::string(args[1])];
-        auto ui = env.builder->CreateFCmpULT(lhs, rhs, "cmptmp");
-        return env.builder->CreateUIToFP(ui, llvm::Type::getDoubleTy(*env.context), "booltmp");
+    const auto& ops = operators();
+    return name == ops.add || name == ops.sub || name == ops.mul || name == ops.div || name == ops.less;
+}
+
+llvm::Value* CodeGenEnvironment::gen_operator(const Symbol op, llvm::Value* lhs, llvm::Value* rhs)
+{
+    const auto& ops = operators();
+    if (op == ops.add)
+    {
+        return this->builder->CreateFAdd(lhs, rhs, "addtmp");
+    }
+    if (op == ops.sub)
+    {
+        return this->builder->CreateFSub(lhs, rhs, "subtmp");
+    }
+    if (op == ops.mul)
+    {
+        return this->builder->CreateFMul(lhs, rhs, "multmp");
+    }
+    if (op == ops.div)
+    {
+        return this->builder->CreateFDiv(lhs, rhs, "divtmp");
+    }
+    if (op == ops.less)
+    {
+        auto ui = this->builder->CreateFCmpULT(lhs, rhs, "cmptmp");
+        return this->builder->CreateUIToFP(ui, llvm::Type::getDoubleTy(*this->context), "booltmp");
+    }
+    return LogError(std::format("`{}` is not an operator", op));
+}
+
+llvm::Value* CodeGenEnvironment::gen_apply(const Symbol fun, llvm::ArrayRef<llvm::Value*> operands)
+{
+    if (operands.size() == 2u && is_operator(fun))
+    {
+        return this->gen_operator(fun, operands[0], operands[1]);
+    }
+
+    const auto callee = this->get_function(fun);
+    if (callee == nullptr)
+    {
+        return nullptr;
+    }
+    const auto params = callee->getFunctionType()->params();
+    if (params.size() != operands.size() || !std::ranges::all_of(params, [](auto ty) { return ty->isDoubleTy(); }))
+    {
+        return LogError(std::format("`{}` must take {} numbers", fun, operands.size()));
+    }
+    return this->builder->CreateCall(callee, operands, "calltmp");
+}
+
+llvm::Value* CodeGenEnvironment::gen_loop(llvm::Value* count, llvm::Value* init,
+                                          llvm::function_ref<llvm::Value*(llvm::Value* index, llvm::Value* acc)> body)
+{
+    const auto i64 = this->builder->getInt64Ty();
+    const auto zero = llvm::ConstantInt::get(i64, 0u);
+    const auto preheader_bb = this->builder->GetInsertBlock();
+    const auto fun = preheader_bb->getParent();
+    const auto loop_bb = llvm::BasicBlock::Create(*this->context, "loop", fun);
+    const auto exit_bb = llvm::BasicBlock::Create(*this->context, "loop.exit", fun);
+    this->builder->CreateCondBr(this->builder->CreateICmpSGT(count, zero, "loop.nonempty"), loop_bb, exit_bb);
+
+    this->builder->SetInsertPoint(loop_bb);
+    const auto index = this->builder->CreatePHI(i64, 2u, "i");
+    const auto acc = this->builder->CreatePHI(init->getType(), 2u, "acc");
+    index->addIncoming(zero, preheader_bb);
+    acc->addIncoming(init, preheader_bb);
+    const auto next_acc = body(index, acc);
+    if (next_acc == nullptr)
+    {
+        return nullptr;
+    }
+    const auto next_index = this->builder->CreateAdd(index, llvm::ConstantInt::get(i64, 1u), "i.next",
+                                                     /*HasNUW=*/true, /*HasNSW=*/true);
+    const auto latch_bb = this->builder->GetInsertBlock();
+    index->addIncoming(next_index, latch_bb);
+    acc->addIncoming(next_acc, latch_bb);
+    this->builder->CreateCondBr(this->builder->CreateICmpSLT(next_index, count, "loop.cond"), loop_bb, exit_bb);
+
+    this->builder->SetInsertPoint(exit_bb);
+    const auto result = this->builder->CreatePHI(init->getType(), 2u, "loop.result");
+    result->addIncoming(init, preheader_bb);
+    result->addIncoming(next_acc, latch_bb);
+    return result;
+}
+
+llvm::Function* CodeGenEnvironment::gen_batch_function(const Symbol name)
+{
+    const auto callee = this->get_function(name);
+    if (callee == nullptr)
+    {
+        return nullptr;
+    }
+
+    const auto ptr_ty = this->builder->getPtrTy();
+    const auto double_ty = this->builder->getDoubleTy();
+    const auto type = llvm::FunctionType::get(this->builder->getVoidTy(), {ptr_ty, ptr_ty, this->builder->getInt64Ty()},
+                                              false);
+    const auto fun = llvm::Function::Create(type, llvm::Function::ExternalLinkage, std::format("{}_batch", name),
+                                            this->module.get());
+    const auto columns = fun->getArg(0u);
+    const auto out = fun->getArg(1u);
+    const auto count = fun->getArg(2u);
+    columns->setName("columns");
+    out->setName("out");
+    count->setName("count");
+    this->builder->SetInsertPoint(llvm::BasicBlock::Create(*this->context, "entry", fun));
+
+    // The column pointers are loop-invariant, so they are loaded once up front.
+    auto column_data = llvm::SmallVector<llvm::Value*, 8>();
+    for (auto idx = 0u; idx < callee->arg_size(); ++idx)
+    {
+        const auto slot = this->builder->CreateConstInBoundsGEP1_64(ptr_ty, columns, idx, "column.ptr");
+        column_data.push_back(this->builder->CreateLoad(ptr_ty, slot, "column"));
+    }
+
+    auto call = static_cast<llvm::CallInst*>(nullptr);
+    const auto unused = llvm::ConstantFP::get(double_ty, 0.0);
+    const auto stored = this->gen_loop(count, unused, [&](llvm::Value* index, llvm::Value* acc) -> llvm::Value* {
+        auto operands = llvm::SmallVector<llvm::Value*, 8>();
+        for (const auto data : column_data)
+        {
+            const auto element = this->builder->CreateInBoundsGEP(double_ty, data, index, "element.ptr");
+            operands.push_back(this->builder->CreateLoad(double_ty, element, "element"));
+        }
+        const auto result = this->gen_apply(name, operands);
+        if (result == nullptr)
+        {
+            return nullptr;
+        }
+        call = llvm::dyn_cast<llvm::CallInst>(result);
+        this->builder->CreateStore(result, this->builder->CreateInBoundsGEP(double_ty, out, index, "out.ptr"));
+        return acc;
     });
+    if (stored == nullptr)
+    {
+        fun->eraseFromParent();
+        return nullptr;
+    }
+    this->builder->CreateRetVoid();
+
+    // Inlined here rather than by the optimizer, which does not inline at all without an `-O` level.
+    if (call != nullptr && !callee->isDeclaration())
+    {
+        auto info = llvm::InlineFunctionInfo();
+        static_cast<void>(llvm::InlineFunction(*call, info));
+    }
+    llvm::verifyFunction(*fun);
+    if (!this->defer_optimization)
+    {
+        this->optimizer->run(*fun);
+    }
+    return fun;
+}
+
+void CodeGenEnvironment::retain_for_inlining(std::shared_ptr<FunctionAST> fun)
+{
+    const auto name = fun->get_prototype().get_name();
+    const auto ir = this->module->getFunction(name.str());
+    if (ir != nullptr && !ir->isDeclaration() && ir->getInstructionCount() <= max_inline_instructions)
+    {
+        this->inlinable_functions[name] = std::move(fun);
+    }
+}
+
+bool CodeGenEnvironment::import_inlinable_functions()
+{
+    auto imported = false;
+    // A re-emitted body may call further retained functions, so repeat until no such declaration is left.
+    while (true)
+    {
+        auto pending = std::vector<Symbol>();
+        for (const auto& fun : *this->module)
+        {
+            const auto name = Symbol::intern(std::string_view(fun.getName()));
+            if (fun.isDeclaration() && this->inlinable_functions.contains(name))
+            {
+                pending.push_back(name);
+            }
+        }
+        if (pending.empty())
+        {
+            return imported;
+        }
+
+        for (const auto name : pending)
+        {
+            const auto fun = (*this->inlinable_functions.find(name))->codegen(*this);
+            if (fun == nullptr)
+            {
+                this->inlinable_functions.erase(name);
+                continue;
+            }
+            fun->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+            fun->addFnAttr(llvm::Attribute::AlwaysInline);
+            imported = true;
+        }
+    }
+}
+
+void CodeGenEnvironment::mark_tail_calls(llvm::Function& fun)
+{
+    auto returns = std::vector<llvm::ReturnInst*>();
+    for (auto& bb : fun)
+    {
+        if (const auto ret = llvm::dyn_cast_or_null<llvm::ReturnInst>(bb.getTerminator()))
+        {
+            returns.push_back(ret);
+        }
+    }
+
+    while (!returns.empty())
+    {
+        const auto ret = returns.back();
+        returns.pop_back();
+        const auto bb = ret->getParent();
+
+        // A block that only merges the branches of an `if` and returns the result: return from the branches instead.
+        const auto phi = llvm::dyn_cast_or_null<llvm::PHINode>(ret->getReturnValue());
+        const auto only_merges = phi != nullptr && &bb->front() == phi && phi->getNextNode() == ret &&
+                                 std::ranges::all_of(phi->blocks(), [](const llvm::BasicBlock* pred) {
+                                     const auto br = llvm::dyn_cast<llvm::BranchInst>(pred->getTerminator());
+                                     return br != nullptr && br->isUnconditional();
+                                 });
+        if (only_merges)
+        {
+            for (auto idx = 0u; idx < phi->getNumIncomingValues(); ++idx)
+            {
+                const auto pred = phi->getIncomingBlock(idx);
+                pred->getTerminator()->eraseFromParent();
+                returns.push_back(llvm::ReturnInst::Create(fun.getContext(), phi->getIncomingValue(idx), pred));
+            }
+            ret->eraseFromParent();
+            phi->eraseFromParent();
+            bb->eraseFromParent();
+            continue;
+        }
+
+        const auto call = llvm::dyn_cast_or_null<llvm::CallInst>(ret->getPrevNode());
+        if (call == nullptr || call != ret->getReturnValue())
+        {
+            continue;
+        }
+        const auto callee = call->getCalledFunction();
+        const auto same_signature = callee != nullptr && callee->getFunctionType() == fun.getFunctionType() &&
+                                    callee->getCallingConv() == fun.getCallingConv();
+        call->setTailCallKind(same_signature ? llvm::CallInst::TCK_MustTail : llvm::CallInst::TCK_Tail);
+    }
+}
+
+void CodeGenEnvironment::declare_operators()
+{
+    const auto args = std::vector<Symbol>{Symbol::intern("x"), Symbol::intern("y")};
+    const auto& ops = operators();
+    for (const auto op : {ops.add, ops.sub, ops.mul, ops.div, ops.less})
+    {
+        this->function_prototypes[op] = std::make_unique<PrototypeAST>(op, args);
+    }
+}
+
+void CodeGenEnvironment::register_operators()
+{
+    const auto args = std::array<Symbol, 2>{Symbol::intern("x"), Symbol::intern("y")};
+    const auto& ops = operators();
+    for (const auto op : {ops.add, ops.sub, ops.mul, ops.div, ops.less})
+    {
+        std::ignore = this->gen_function(op, args, [op, &args](auto& env) {
+            return env.gen_operator(op, env.named_values[args[0]], env.named_values[args[1]]);
+        });
+    }
 }
 } // namespace ks
@@ -0,0 +1,188 @@
+#include "hot_swap.hpp"
+
+#include <format>
+#include <iostream>
+#include <utility>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/Error.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+HotSwapper::HotSwapper(JITCompiler& _jit_compiler, std::unique_ptr<llvm::orc::IndirectStubsManager> _stubs)
+    : versions(_jit_compiler, std::move(_stubs))
+{
+}
+
+llvm::Expected<std::unique_ptr<HotSwapper>> HotSwapper::create(JITCompiler& jit_compiler)
+{
+    auto stubs = jit_compiler.create_indirect_stubs_manager();
+    if (!stubs)
+    {
+        return stubs.takeError();
+    }
+    return std::make_unique<HotSwapper>(jit_compiler, std::move(*stubs));
+}
+
+void HotSwapper::declare(const PrototypeAST& proto)
+{
+    this->versions.declare(proto);
+}
+
+bool HotSwapper::define(std::unique_ptr<FunctionAST> fun)
+{
+    const auto name = fun->get_prototype().get_name();
+    {
+        const auto lock = std::scoped_lock(this->mutex);
+        if (this->functions.contains(name))
+        {
+            if (!this->versions.find(name)->has_same_parameters(fun->get_prototype()))
+            {
+                return VersionedStubs::LogError(
+                    std::format("Function `{}` must keep its parameters when it is redefined.", name));
+            }
+            // Redefinitions of the same function are swapped in the order they were made.
+            this->versions.post([this, redefinition = Redefinition{name, std::move(fun)}]() mutable {
+                this->swap(std::move(redefinition));
+            });
+            return true;
+        }
+        this->versions.declare(fun->get_prototype());
+    }
+
+    auto version = this->compile(name, *fun, 0u);
+    if (!version)
+    {
+        this->versions.forget(name);
+        return false;
+    }
+    if (!this->versions.define_stub(name, version->code))
+    {
+        return false;
+    }
+
+    const auto lock = std::scoped_lock(this->mutex);
+    this->functions[name] = SwappableFunction{std::move(*version), 1u};
+    return true;
+}
+
+bool HotSwapper::wait_until_swapped()
+{
+    this->versions.wait_until_idle();
+    return this->failed.exchange(0u) == 0u;
+}
+
+void HotSwapper::swap(Redefinition redefinition)
+{
+    const auto name = redefinition.name;
+    auto number = 0u;
+    {
+        const auto lock = std::scoped_lock(this->mutex);
+        number = this->functions[name].versions++;
+    }
+
+    auto version = this->compile(name, *redefinition.ast, number);
+    if (!version)
+    {
+        std::cerr << std::format("Redefining `{}` failed; the previous definition stays in place\n", name);
+        ++this->failed;
+        return;
+    }
+
+    const auto lock = std::scoped_lock(this->mutex);
+    if (auto err = this->versions.update_stub(name, version->code.address))
+    {
+        std::cerr << llvm::toString(std::move(err)) << '\n';
+        this->retired.push_back(std::move(*version));
+        ++this->failed;
+        return;
+    }
+    auto& fun = this->functions[name];
+    this->retired.push_back(std::exchange(fun.current, std::move(*version)));
+    this->versions.declare(redefinition.ast->get_prototype());
+    ++this->swapped;
+}
+
+void HotSwapper::collect()
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    auto still_active = std::vector<Version>();
+    for (auto& version : this->retired)
+    {
+        if (std::atomic_ref<std::int64_t>(*version.active).load() != 0)
+        {
+            still_active.push_back(std::move(version));
+        }
+        else if (auto err = version.code.resource_tracker->remove())
+        {
+            std::cerr << llvm::toString(std::move(err)) << '\n';
+        }
+        else
+        {
+            ++this->freed;
+        }
+    }
+    this->retired = std::move(still_active);
+}
+
+std::optional<HotSwapper::Version> HotSwapper::compile(const Symbol name, FunctionAST& ast, const unsigned version)
+{
+    auto env = this->versions.generate(name, ast, version);
+    if (!env)
+    {
+        return std::nullopt;
+    }
+    auto active = std::make_unique<std::int64_t>(0);
+    count_active_calls(*env->module->getFunction(VersionedStubs::version_name(name, version)), active.get());
+
+    auto code = this->versions.compile(*env, name, version);
+    if (!code)
+    {
+        VersionedStubs::LogError(llvm::toString(code.takeError()));
+        return std::nullopt;
+    }
+    return Version{std::move(*code), std::move(active)};
+}
+
+void HotSwapper::count_active_calls(llvm::Function& fun, std::int64_t* active)
+{
+    auto builder = llvm::IRBuilder<>(fun.getContext());
+    const auto counter = llvm::ConstantExpr::getIntToPtr(
+        builder.getInt64(llvm::orc::ExecutorAddr::fromPtr(active).getValue()), builder.getPtrTy());
+    const auto add = [&builder, counter](const std::int64_t delta) {
+        builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter,
+                                llvm::ConstantInt::getSigned(builder.getInt64Ty(), delta), llvm::MaybeAlign(8u),
+                                llvm::AtomicOrdering::SequentiallyConsistent);
+    };
+
+    auto exits = std::vector<llvm::Instruction*>();
+    for (auto& bb : fun)
+    {
+        if (const auto ret = llvm::dyn_cast_or_null<llvm::ReturnInst>(bb.getTerminator()))
+        {
+            // Nothing may come between a `musttail` call and the return; a call only marked `tail` can give up the
+            // tail position instead, so that the count drops only once it has returned.
+            const auto call = llvm::dyn_cast_or_null<llvm::CallInst>(ret->getPrevNode());
+            exits.push_back(call != nullptr && call->isMustTailCall() ? static_cast<llvm::Instruction*>(call) : ret);
+        }
+    }
+    for (const auto exit : exits)
+    {
+        builder.SetInsertPoint(exit);
+        add(-1);
+    }
+    builder.SetInsertPoint(&*fun.getEntryBlock().getFirstInsertionPt());
+    add(1);
+    llvm::verifyFunction(fun);
+}
+} // namespace ks
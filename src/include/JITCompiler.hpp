@@ -1,56 +1,238 @@
 #pragma once
 
+#include <atomic>
+#include <cstdlib>
+#include <format>
+#include <functional>
+#include <iostream>
 #include <memory>
+#include <string>
+#include <vector>
 
 #if defined(__clang__)
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Weverything"
 #endif
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/FunctionExtras.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/Mangling.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/CodeGen.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
 #if defined(__clang__)
 #pragma clang diagnostic pop
 #endif
 
+#include "object_cache.hpp"
+#include "optimizer.hpp"
+#include "perf_map.hpp"
+#include "statistics.hpp"
+
 namespace ks
 {
 
+struct JITOptions
+{
+    /// Emit a lazy call-through stub per function and compile its body on the first call.
+    bool lazy = false;
+    /// Materialize on a pool of up to this many threads; 0 compiles on the thread that triggers the lookup.
+    unsigned compile_threads = 0u;
+    /// Directory for cached objects; empty disables the cache.
+    std::string cache_directory{};
+    llvm::CodeGenOptLevel codegen_opt_level = llvm::CodeGenOptLevel::Default;
+    /// Not owned; null disables the statistics, though time-trace entries are still recorded.
+    Statistics* statistics = nullptr;
+    /// Keep `/tmp/perf-<pid>.map` up to date with the loaded functions, for `perf report`.
+    bool perf_map = false;
+};
+
+/// Times each module's object emission.
+class TimedIRCompiler final : public llvm::orc::IRCompileLayer::IRCompiler
+{
+  public:
+    TimedIRCompiler(std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler> _compiler, Statistics* _statistics)
+        : IRCompiler(_compiler->getManglingOptions()), compiler(std::move(_compiler)), statistics(_statistics)
+    {
+    }
+
+    llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(llvm::Module& module) override
+    {
+        const auto scope = Statistics::Scope(this->statistics, Phase::EMISSION);
+        return (*this->compiler)(module);
+    }
+
+  private:
+    std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler> compiler;
+    Statistics* statistics;
+};
+
+/// Times loading, relocating and finalizing each object.
+class TimedObjectLinkingLayer final : public llvm::orc::RTDyldObjectLinkingLayer
+{
+  public:
+    TimedObjectLinkingLayer(llvm::orc::ExecutionSession& session, GetMemoryManagerFunction get_memory_manager,
+                            Statistics* _statistics)
+        : RTDyldObjectLinkingLayer(session, std::move(get_memory_manager)), statistics(_statistics)
+    {
+    }
+
+    void emit(std::unique_ptr<llvm::orc::MaterializationResponsibility> responsibility,
+              std::unique_ptr<llvm::MemoryBuffer> object) override
+    {
+        const auto scope = Statistics::Scope(this->statistics, Phase::LINKING);
+        RTDyldObjectLinkingLayer::emit(std::move(responsibility), std::move(object));
+    }
+
+  private:
+    Statistics* statistics;
+};
+
+/// Creates the pipeline a lazy JIT runs on each function it compiles.
+using OptimizerFactory = std::function<llvm::Expected<std::unique_ptr<OptimizationPipeline>>()>;
+
 class JITCompiler
 {
   private:
     std::unique_ptr<llvm::orc::ExecutionSession> session;
     llvm::DataLayout layout;
+    llvm::orc::JITTargetMachineBuilder target_machine_builder;
     llvm::orc::MangleAndInterner mangle;
-    llvm::orc::RTDyldObjectLinkingLayer object_layer;
+    /// Empty on targets without indirect stubs.
+    llvm::orc::CompileOnDemandLayer::IndirectStubsManagerBuilder indirect_stubs_manager_builder;
+    std::unique_ptr<ObjectCache> object_cache;
+    Statistics* statistics;
+    /// Declared before the object layer, which notifies it of the objects it frees when destroyed.
+    std::unique_ptr<PerfMapListener> perf_map;
+    TimedObjectLinkingLayer object_layer;
     llvm::orc::IRCompileLayer compile_layer;
+    llvm::orc::IRTransformLayer counting_layer;
+    /// Under the compile-on-demand layer, so that only the functions that get called are optimized. A fresh pipeline
+    /// is created for each of them, as they may be compiled concurrently.
+    OptimizerFactory optimizer_factory{};
+    llvm::orc::IRTransformLayer optimize_layer;
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> lazy_call_through_manager;
+    std::unique_ptr<llvm::orc::CompileOnDemandLayer> compile_on_demand_layer;
     llvm::orc::JITDylib& main_dylib;
+    std::atomic<std::size_t> functions_added = 0u;
+    std::atomic<std::size_t> functions_materialized = 0u;
+
+    static std::size_t count_definitions(const llvm::Module& module)
+    {
+        auto count = std::size_t(0);
+        for (const auto& fun : module)
+        {
+            count += fun.isDeclaration() ? 0u : 1u;
+        }
+        return count;
+    }
+
+    static void handle_lazy_call_through_error()
+    {
+        std::cerr << "Lazy compilation failed\n";
+        std::exit(1);
+    }
 
   public:
     JITCompiler(std::unique_ptr<llvm::orc::ExecutionSession> _session, llvm::orc::JITTargetMachineBuilder builder,
-                llvm::DataLayout _layout)
-        : session(std::move(_session)), layout(std::move(_layout)), mangle(*this->session, this->layout),
-          object_layer(*this->session, []() { return std::make_unique<llvm::SectionMemoryManager>(); }),
+                llvm::DataLayout _layout,
+                std::unique_ptr<llvm::orc::LazyCallThroughManager> _lazy_call_through_manager = nullptr,
+                std::unique_ptr<ObjectCache> _object_cache = nullptr, Statistics* _statistics = nullptr,
+                std::unique_ptr<PerfMapListener> _perf_map = nullptr)
+        : session(std::move(_session)), layout(std::move(_layout)), target_machine_builder(builder),
+          mangle(*this->session, this->layout),
+          indirect_stubs_manager_builder(llvm::orc::createLocalIndirectStubsManagerBuilder(
+              this->session->getExecutorProcessControl().getTargetTriple())),
+          object_cache(std::move(_object_cache)), statistics(_statistics), perf_map(std::move(_perf_map)),
+          object_layer(
+              *this->session, []() { return std::make_unique<llvm::SectionMemoryManager>(); }, this->statistics),
           compile_layer(*this->session, this->object_layer,
-                        std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(builder))),
+                        std::make_unique<TimedIRCompiler>(std::make_unique<llvm::orc::ConcurrentIRCompiler>(
+                                                              std::move(builder), this->object_cache.get()),
+                                                          this->statistics)),
+          counting_layer(*this->session, this->compile_layer,
+                         [this](llvm::orc::ThreadSafeModule module, llvm::orc::MaterializationResponsibility&) {
+                             module.withModuleDo([this](llvm::Module& m) {
+                                 const auto definitions = count_definitions(m);
+                                 this->functions_materialized += definitions;
+                                 if (this->statistics != nullptr)
+                                 {
+                                     this->statistics->add_module(definitions, m.getInstructionCount());
+                                 }
+                             });
+                             return llvm::Expected<llvm::orc::ThreadSafeModule>(std::move(module));
+                         }),
+          optimize_layer(*this->session, this->counting_layer,
+                         [this](llvm::orc::ThreadSafeModule module, llvm::orc::MaterializationResponsibility&)
+                             -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+                             if (!this->optimizer_factory)
+                             {
+                                 return llvm::Expected<llvm::orc::ThreadSafeModule>(std::move(module));
+                             }
+                             auto optimizer = this->optimizer_factory();
+                             if (!optimizer)
+                             {
+                                 return optimizer.takeError();
+                             }
+                             module.withModuleDo([&optimizer](llvm::Module& m) { (*optimizer)->optimize(m); });
+                             return llvm::Expected<llvm::orc::ThreadSafeModule>(std::move(module));
+                         }),
+          lazy_call_through_manager(std::move(_lazy_call_through_manager)),
           main_dylib(this->session->createBareJITDylib("<main>"))
     {
+        const auto& triple = this->session->getExecutorProcessControl().getTargetTriple();
+        if (this->lazy_call_through_manager && this->indirect_stubs_manager_builder)
+        {
+            this->compile_on_demand_layer = std::make_unique<llvm::orc::CompileOnDemandLayer>(
+                *this->session, this->optimize_layer, *this->lazy_call_through_manager,
+                this->indirect_stubs_manager_builder);
+        }
         this->main_dylib.addGenerator(llvm::cantFail(
             llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(this->layout.getGlobalPrefix())));
-        if (builder.getTargetTriple().isOSBinFormatCOFF())
+        if (this->statistics != nullptr)
+        {
+            this->object_layer.setNotifyLoaded([statistics = this->statistics](
+                                                   llvm::orc::MaterializationResponsibility&,
+                                                   const llvm::object::ObjectFile& object,
+                                                   const llvm::RuntimeDyld::LoadedObjectInfo&) {
+                for (const auto& [symbol, size] : llvm::object::computeSymbolSizes(object))
+                {
+                    auto type = symbol.getType();
+                    auto name = symbol.getName();
+                    if (type && *type == llvm::object::SymbolRef::ST_Function && name)
+                    {
+                        statistics->add_code_size(*name, size);
+                    }
+                    llvm::consumeError(type.takeError());
+                    llvm::consumeError(name.takeError());
+                }
+            });
+        }
+        if (this->perf_map)
+        {
+            this->object_layer.registerJITEventListener(*this->perf_map);
+        }
+        if (triple.isOSBinFormatCOFF())
         {
             this->object_layer.setOverrideObjectFlagsWithResponsibilityFlags(true);
             this->object_layer.setAutoClaimResponsibilityForObjectSymbols(true);
@@ -65,26 +247,81 @@ class JITCompiler
         }
     }
 
-    static llvm::Expected<std::unique_ptr<JITCompiler>> create()
+    static llvm::Expected<std::unique_ptr<JITCompiler>> create(const JITOptions& options = JITOptions())
     {
         llvm::InitializeNativeTarget();
         llvm::InitializeNativeTargetAsmParser();
         llvm::InitializeNativeTargetAsmPrinter();
-        auto epc = llvm::orc::SelfExecutorProcessControl::Create();
+        auto dispatcher = std::unique_ptr<llvm::orc::TaskDispatcher>();
+        if (options.compile_threads > 0u)
+        {
+            dispatcher = std::make_unique<llvm::orc::DynamicThreadPoolTaskDispatcher>(options.compile_threads);
+        }
+        auto epc = llvm::orc::SelfExecutorProcessControl::Create(nullptr, std::move(dispatcher));
         if (!epc)
         {
             return epc.takeError();
         }
 
         auto session = std::make_unique<llvm::orc::ExecutionSession>(std::move(*epc));
-        auto builder = llvm::orc::JITTargetMachineBuilder(session->getExecutorProcessControl().getTargetTriple());
+        const auto& triple = session->getExecutorProcessControl().getTargetTriple();
+        // Code runs in this process, so it may use every feature of the host CPU.
+        auto host = llvm::orc::JITTargetMachineBuilder::detectHost();
+        if (!host)
+        {
+            return host.takeError();
+        }
+        auto builder = std::move(*host);
+        builder.setCodeGenOptLevel(options.codegen_opt_level);
 
         auto layout = builder.getDefaultDataLayoutForTarget();
         if (!layout)
         {
             return layout.takeError();
         }
-        return std::make_unique<JITCompiler>(std::move(session), std::move(builder), std::move(*layout));
+
+        auto lazy_call_through_manager = std::unique_ptr<llvm::orc::LazyCallThroughManager>();
+        if (options.lazy)
+        {
+            if (!llvm::orc::createLocalIndirectStubsManagerBuilder(triple))
+            {
+                return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                               std::format("Lazy compilation is not supported on {}", triple.str()));
+            }
+            auto manager = llvm::orc::createLocalLazyCallThroughManager(
+                triple, *session, llvm::orc::ExecutorAddr::fromPtr(&handle_lazy_call_through_error));
+            if (!manager)
+            {
+                return manager.takeError();
+            }
+            lazy_call_through_manager = std::move(*manager);
+        }
+        auto object_cache = std::unique_ptr<ObjectCache>();
+        if (!options.cache_directory.empty())
+        {
+            auto target_key = std::format("{}|{}|{}|O{}", builder.getTargetTriple().str(), builder.getCPU(),
+                                          builder.getFeatures().getString(),
+                                          static_cast<int>(options.codegen_opt_level));
+            auto cache = ObjectCache::create(options.cache_directory, std::move(target_key));
+            if (!cache)
+            {
+                return cache.takeError();
+            }
+            object_cache = std::move(*cache);
+        }
+        auto perf_map = std::unique_ptr<PerfMapListener>();
+        if (options.perf_map)
+        {
+            auto listener = PerfMapListener::create();
+            if (!listener)
+            {
+                return listener.takeError();
+            }
+            perf_map = std::move(*listener);
+        }
+        return std::make_unique<JITCompiler>(std::move(session), std::move(builder), std::move(*layout),
+                                             std::move(lazy_call_through_manager), std::move(object_cache),
+                                             options.statistics, std::move(perf_map));
     }
 
     llvm::Error add_module(llvm::orc::ThreadSafeModule module, llvm::orc::ResourceTrackerSP resource_tracker = nullptr)
@@ -94,13 +331,129 @@ class JITCompiler
             resource_tracker = this->main_dylib.getDefaultResourceTracker();
         }
 
-        return this->compile_layer.add(std::move(resource_tracker), std::move(module));
+        module.withModuleDo([this](llvm::Module& m) { this->functions_added += count_definitions(m); });
+        if (this->compile_on_demand_layer)
+        {
+            return this->compile_on_demand_layer->add(std::move(resource_tracker), std::move(module));
+        }
+        return this->counting_layer.add(std::move(resource_tracker), std::move(module));
+    }
+
+    /// Links a relocatable object compiled ahead of time, e.g. the prelude, skipping IR generation and codegen. The
+    /// object must be built for the architecture the JIT runs on.
+    llvm::Error add_object(std::unique_ptr<llvm::MemoryBuffer> object,
+                           llvm::orc::ResourceTrackerSP resource_tracker = nullptr)
+    {
+        auto file = llvm::object::ObjectFile::createObjectFile(object->getMemBufferRef());
+        if (!file)
+        {
+            return file.takeError();
+        }
+        const auto& triple = this->session->getExecutorProcessControl().getTargetTriple();
+        if ((*file)->getArch() != triple.getArch() || (*file)->getTripleObjectFormat() != triple.getObjectFormat())
+        {
+            return llvm::createStringError(
+                llvm::inconvertibleErrorCode(),
+                std::format("`{}` is a {} object, which cannot be linked into a {} JIT",
+                            object->getBufferIdentifier().str(),
+                            llvm::Triple::getArchTypeName((*file)->getArch()).str(), triple.str()));
+        }
+
+        if (!resource_tracker)
+        {
+            resource_tracker = this->main_dylib.getDefaultResourceTracker();
+        }
+        return this->object_layer.add(std::move(resource_tracker), std::move(object));
     }
 
     llvm::Expected<llvm::orc::ExecutorSymbolDef> lookup(llvm::StringRef name)
     {
-        return this->session->lookup({&this->main_dylib},
-                                     llvm::orc::MangleAndInterner(*this->session, this->layout)(name.str()));
+        const auto scope = Statistics::Scope(this->statistics, Phase::LOOKUP, name);
+        return this->session->lookup({&this->main_dylib}, this->mangle(name.str()));
+    }
+
+    /// Looks all `names` up in one query, so their materialization can be dispatched at once, and returns their
+    /// definitions in the same order. Blocks only until these symbols (and what they depend on) are ready.
+    llvm::Expected<std::vector<llvm::orc::ExecutorSymbolDef>> lookup_all(llvm::ArrayRef<std::string> names)
+    {
+        const auto scope = Statistics::Scope(this->statistics, Phase::LOOKUP);
+        auto symbols = llvm::orc::SymbolLookupSet();
+        for (const auto& name : names)
+        {
+            symbols.add(this->mangle(name));
+        }
+        auto found = this->session->lookup(llvm::orc::makeJITDylibSearchOrder(&this->main_dylib), std::move(symbols));
+        if (!found)
+        {
+            return found.takeError();
+        }
+
+        auto definitions = std::vector<llvm::orc::ExecutorSymbolDef>();
+        definitions.reserve(names.size());
+        for (const auto& name : names)
+        {
+            definitions.push_back((*found)[this->mangle(name)]);
+        }
+        return definitions;
+    }
+
+    using LookupCallback = llvm::unique_function<void(llvm::Expected<std::vector<llvm::orc::ExecutorSymbolDef>>)>;
+
+    /// Like `lookup_all`, but returns at once. `on_ready` runs once the symbols are ready, on whichever thread finished
+    /// materializing them, so it must not touch state owned by the caller's thread.
+    void lookup_all_async(llvm::ArrayRef<std::string> names, LookupCallback on_ready)
+    {
+        auto symbols = llvm::orc::SymbolLookupSet();
+        auto mangled = std::vector<llvm::orc::SymbolStringPtr>();
+        mangled.reserve(names.size());
+        for (const auto& name : names)
+        {
+            mangled.push_back(this->mangle(name));
+            symbols.add(mangled.back());
+        }
+        this->session->lookup(
+            llvm::orc::LookupKind::Static, llvm::orc::makeJITDylibSearchOrder(&this->main_dylib), std::move(symbols),
+            llvm::orc::SymbolState::Ready,
+            [mangled = std::move(mangled), on_ready = std::move(on_ready)](
+                llvm::Expected<llvm::orc::SymbolMap> found) mutable {
+                if (!found)
+                {
+                    on_ready(found.takeError());
+                    return;
+                }
+                auto definitions = std::vector<llvm::orc::ExecutorSymbolDef>();
+                definitions.reserve(mangled.size());
+                for (const auto& name : mangled)
+                {
+                    definitions.push_back((*found)[name]);
+                }
+                on_ready(std::move(definitions));
+            },
+            llvm::orc::NoDependenciesToRegister);
+    }
+
+    /// Stubs whose target can be changed while code calls through them. Fails on targets without indirect stubs.
+    llvm::Expected<std::unique_ptr<llvm::orc::IndirectStubsManager>> create_indirect_stubs_manager()
+    {
+        if (!this->indirect_stubs_manager_builder)
+        {
+            const auto& triple = this->session->getExecutorProcessControl().getTargetTriple();
+            return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                           std::format("Indirect stubs are not supported on {}", triple.str()));
+        }
+        return this->indirect_stubs_manager_builder();
+    }
+
+    /// Makes `name` resolve to `definition`, e.g. a stub, in the main dylib.
+    llvm::Error define_absolute(llvm::StringRef name, llvm::orc::ExecutorSymbolDef definition)
+    {
+        return this->main_dylib.define(llvm::orc::absoluteSymbols({{this->mangle(name.str()), definition}}));
+    }
+
+    /// A target machine configured like the one that compiles JIT'd code, for target-aware IR optimization.
+    llvm::Expected<std::unique_ptr<llvm::TargetMachine>> create_target_machine()
+    {
+        return this->target_machine_builder.createTargetMachine();
     }
 
     const llvm::DataLayout& get_data_layout() const
@@ -112,5 +465,40 @@ class JITCompiler
     {
         return this->main_dylib;
     }
+
+    /// In lazy mode, optimizes each function with a pipeline from `factory` when it is compiled, for modules that were
+    /// generated with `CodeGenEnvironment::defer_optimization`. Must be set before any module is added.
+    void optimize_lazily(OptimizerFactory factory)
+    {
+        this->optimizer_factory = std::move(factory);
+    }
+
+    bool is_lazy() const
+    {
+        return this->compile_on_demand_layer != nullptr;
+    }
+
+    /// Function bodies that were added but never compiled; only non-zero in lazy mode.
+    std::size_t count_unmaterialized_functions() const
+    {
+        const auto added = this->functions_added.load();
+        const auto materialized = this->functions_materialized.load();
+        return added > materialized ? added - materialized : 0u;
+    }
+
+    std::size_t count_added_functions() const
+    {
+        return this->functions_added.load();
+    }
+
+    const ObjectCache* get_object_cache() const
+    {
+        return this->object_cache.get();
+    }
+
+    const PerfMapListener* get_perf_map() const
+    {
+        return this->perf_map.get();
+    }
 };
 } // namespace ks
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <algorithm>
 #include <format>
 #include <memory>
+#include <optional>
+#include <set>
+#include <span>
 #include <sstream>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #if defined(__clang__)
@@ -12,44 +18,124 @@
 #endif
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Value.h"
+#include "llvm/Support/Allocator.h"
 #if defined(__clang__)
 #pragma clang diagnostic pop
 #endif
 
+#include "symbol.hpp"
+
 namespace ks
 {
 class CodeGenEnvironment;
+class Interpreter;
+
+/// Variables and parameters whose names end in `[]` hold arrays of doubles. Generated code passes an array as a
+/// pointer to its first element followed by its length as an `i64`.
+inline bool is_array_name(const Symbol name)
+{
+    return name.str().ends_with("[]");
+}
+
+struct ArrayValue
+{
+    llvm::Value* data;
+    llvm::Value* length;
+};
+
+/// Bump allocator owning every expression node of one top-level form. Nodes are never destroyed one by one; the arena
+/// is released as a whole together with the `FunctionAST` that owns it.
+class ASTArena
+{
+    llvm::BumpPtrAllocator allocator;
+
+  public:
+    template <typename T, typename... Args> T* make(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena nodes are never destroyed");
+        return new (this->allocator.Allocate<T>()) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T> std::span<T> copy_array(std::span<const T> items)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena nodes are never destroyed");
+        if (items.empty())
+        {
+            return {};
+        }
+        const auto data = std::span<T>(this->allocator.Allocate<T>(items.size()), items.size());
+        std::ranges::uninitialized_copy(items, data);
+        return data;
+    }
+};
+
 class ExprAST
 {
   public:
-    virtual ~ExprAST() = default;
     virtual std::string to_string() const = 0;
     virtual llvm::Value* codegen(CodeGenEnvironment& env) = 0;
+    /// Tree-walking evaluation for code that is not (yet) compiled. Errors are reported and yield `std::nullopt`.
+    virtual std::optional<double> evaluate(Interpreter& interpreter) const = 0;
+    /// Generates an expression in a position that expects an array. Only array variables qualify.
+    virtual std::optional<ArrayValue> codegen_array(CodeGenEnvironment& env);
+    /// Appends every function the expression calls or passes to `map`, `zip` and `reduce`, with repetitions.
+    virtual void collect_callees(std::vector<Symbol>& callees) const = 0;
+    /// Evaluation in tail position: a call is handed back to the interpreter instead of being made from here.
+    virtual std::optional<double> evaluate_tail(Interpreter& interpreter) const
+    {
+        return this->evaluate(interpreter);
+    }
+
+  protected:
+    ~ExprAST() = default;
 };
 
-class VariableExprAST : public ExprAST
+class NumberExprAST final : public ExprAST
 {
-    std::string name;
+    double value;
 
   public:
-    VariableExprAST(const std::string& _name) : name(_name)
+    NumberExprAST(double _value) : value(_value)
+    {
+    }
+    virtual std::string to_string() const override
+    {
+        return std::format("Number({})", this->value);
+    }
+    virtual void collect_callees(std::vector<Symbol>&) const override
+    {
+    }
+    virtual llvm::Value* codegen(CodeGenEnvironment& env) override;
+    virtual std::optional<double> evaluate(Interpreter& interpreter) const override;
+};
+
+class VariableExprAST final : public ExprAST
+{
+    Symbol name;
+
+  public:
+    VariableExprAST(Symbol _name) : name(_name)
     {
     }
     virtual std::string to_string() const override
     {
         return std::format("Variable({})", this->name);
     }
+    virtual void collect_callees(std::vector<Symbol>&) const override
+    {
+    }
     virtual llvm::Value* codegen(CodeGenEnvironment& env) override;
+    virtual std::optional<ArrayValue> codegen_array(CodeGenEnvironment& env) override;
+    virtual std::optional<double> evaluate(Interpreter& interpreter) const override;
 };
 
-class CallExprAST : public ExprAST
+class CallExprAST final : public ExprAST
 {
-    std::string callee;
-    std::vector<std::unique_ptr<ExprAST>> args;
+    Symbol callee;
+    std::span<ExprAST*> args;
 
   public:
-    CallExprAST(std::string _callee, std::vector<std::unique_ptr<ExprAST>> _args)
-        : callee(std::move(_callee)), args(std::move(_args))
+    CallExprAST(Symbol _callee, std::span<ExprAST*> _args) : callee(_callee), args(_args)
     {
     }
 
@@ -63,33 +149,181 @@ class CallExprAST : public ExprAST
         return std::format("CALL(fun: {}, args: [{}])", this->callee, ss.str());
     }
 
+    virtual void collect_callees(std::vector<Symbol>& callees) const override
+    {
+        callees.push_back(this->callee);
+        for (const auto arg : this->args)
+        {
+            arg->collect_callees(callees);
+        }
+    }
+
+    virtual llvm::Value* codegen(CodeGenEnvironment& env) override;
+    virtual std::optional<double> evaluate(Interpreter& interpreter) const override;
+    virtual std::optional<double> evaluate_tail(Interpreter& interpreter) const override;
+};
+
+/// `(if cond then else)`: `then` when `cond` is neither zero nor NaN. Only the chosen branch is evaluated.
+class IfExprAST final : public ExprAST
+{
+    ExprAST* cond;
+    ExprAST* then;
+    ExprAST* otherwise;
+
+  public:
+    IfExprAST(ExprAST* _cond, ExprAST* _then, ExprAST* _otherwise) : cond(_cond), then(_then), otherwise(_otherwise)
+    {
+    }
+
+    virtual std::string to_string() const override
+    {
+        return std::format("If(cond: {}, then: {}, else: {})", this->cond->to_string(), this->then->to_string(),
+                           this->otherwise->to_string());
+    }
+
+    virtual void collect_callees(std::vector<Symbol>& callees) const override
+    {
+        this->cond->collect_callees(callees);
+        this->then->collect_callees(callees);
+        this->otherwise->collect_callees(callees);
+    }
+
+    virtual llvm::Value* codegen(CodeGenEnvironment& env) override;
+    virtual std::optional<double> evaluate(Interpreter& interpreter) const override;
+    virtual std::optional<double> evaluate_tail(Interpreter& interpreter) const override;
+
+  private:
+    std::optional<bool> evaluate_condition(Interpreter& interpreter) const;
+};
+
+/// `(len xs[])`: the number of elements of an array.
+class LenExprAST final : public ExprAST
+{
+    ExprAST* array;
+
+  public:
+    LenExprAST(ExprAST* _array) : array(_array)
+    {
+    }
+
+    virtual std::string to_string() const override
+    {
+        return std::format("Len({})", this->array->to_string());
+    }
+
+    virtual void collect_callees(std::vector<Symbol>& callees) const override
+    {
+        this->array->collect_callees(callees);
+    }
+
     virtual llvm::Value* codegen(CodeGenEnvironment& env) override;
+    virtual std::optional<double> evaluate(Interpreter& interpreter) const override;
+};
+
+/// `(map f xs[] out[])` and `(zip f xs[] ys[] out[])`: stores `f` of the inputs' elements into `out[]`, element by
+/// element, up to the length of the shortest array. Evaluates to the number of elements stored.
+class MapExprAST final : public ExprAST
+{
+    Symbol fun;
+    std::span<ExprAST*> inputs;
+    ExprAST* output;
+
+  public:
+    MapExprAST(Symbol _fun, std::span<ExprAST*> _inputs, ExprAST* _output)
+        : fun(_fun), inputs(_inputs), output(_output)
+    {
+    }
+
+    virtual std::string to_string() const override
+    {
+        auto ss = std::stringstream();
+        for (const auto& input : this->inputs)
+        {
+            ss << input->to_string() << ',';
+        }
+        return std::format("Map(fun: {}, inputs: [{}], output: {})", this->fun, ss.str(), this->output->to_string());
+    }
+
+    virtual void collect_callees(std::vector<Symbol>& callees) const override
+    {
+        callees.push_back(this->fun);
+        for (const auto input : this->inputs)
+        {
+            input->collect_callees(callees);
+        }
+        this->output->collect_callees(callees);
+    }
+
+    virtual llvm::Value* codegen(CodeGenEnvironment& env) override;
+    virtual std::optional<double> evaluate(Interpreter& interpreter) const override;
+};
+
+/// `(reduce f init xs[])`: folds `xs[]` from the left with `f`, starting from `init`. A built-in operator may be
+/// reassociated, so that the loop vectorizes.
+class ReduceExprAST final : public ExprAST
+{
+    Symbol fun;
+    ExprAST* init;
+    ExprAST* array;
+
+  public:
+    ReduceExprAST(Symbol _fun, ExprAST* _init, ExprAST* _array) : fun(_fun), init(_init), array(_array)
+    {
+    }
+
+    virtual std::string to_string() const override
+    {
+        return std::format("Reduce(fun: {}, init: {}, array: {})", this->fun, this->init->to_string(),
+                           this->array->to_string());
+    }
+
+    virtual void collect_callees(std::vector<Symbol>& callees) const override
+    {
+        callees.push_back(this->fun);
+        this->init->collect_callees(callees);
+        this->array->collect_callees(callees);
+    }
+
+    virtual llvm::Value* codegen(CodeGenEnvironment& env) override;
+    virtual std::optional<double> evaluate(Interpreter& interpreter) const override;
 };
 
 class PrototypeAST
 {
-    std::string name;
-    std::vector<std::string> args;
+    Symbol name;
+    std::vector<Symbol> args;
 
   public:
-    PrototypeAST(const std::string _name, std::vector<std::string> _args) : name(_name), args(std::move(_args))
+    PrototypeAST(Symbol _name, std::vector<Symbol> _args) : name(_name), args(std::move(_args))
     {
     }
-    const std::string& get_name() const
+    Symbol get_name() const
     {
         return this->name;
     }
-    const std::vector<std::string> get_args() const
+    const std::vector<Symbol>& get_args() const
     {
         return this->args;
     }
+    bool takes_arrays() const
+    {
+        return std::ranges::any_of(this->args, is_array_name);
+    }
+    /// Whether callers pass the same arguments to both: parameter names may differ, their number and which of them
+    /// are arrays may not.
+    bool has_same_parameters(const PrototypeAST& other) const
+    {
+        return std::ranges::equal(this->args, other.args, [](const Symbol lhs, const Symbol rhs) {
+            return is_array_name(lhs) == is_array_name(rhs);
+        });
+    }
     llvm::Function* codegen(CodeGenEnvironment& env);
     std::string to_string() const
     {
         auto ss = std::stringstream();
         for (const auto& arg : this->args)
         {
-            ss << arg << ',';
+            ss << arg.str() << ',';
         }
         return std::format("Prototype(name: {}, args [{}])", this->name, ss.str());
     }
@@ -97,16 +331,20 @@ class PrototypeAST
 
 class FunctionAST
 {
+    std::unique_ptr<ASTArena> arena;
     std::unique_ptr<PrototypeAST> proto;
-    std::unique_ptr<ExprAST> body;
+    ExprAST* body;
     bool is_top_level;
 
   public:
-    FunctionAST(std::unique_ptr<PrototypeAST> _proto, std::unique_ptr<ExprAST> _body, bool _is_top_level = false)
-        : proto(std::move(_proto)), body(std::move(_body)), is_top_level(_is_top_level)
+    FunctionAST(std::unique_ptr<ASTArena> _arena, std::unique_ptr<PrototypeAST> _proto, ExprAST* _body,
+                bool _is_top_level = false)
+        : arena(std::move(_arena)), proto(std::move(_proto)), body(_body), is_top_level(_is_top_level)
     {
     }
     llvm::Function* codegen(CodeGenEnvironment& env);
+    std::optional<double> evaluate(Interpreter& interpreter) const;
+    std::optional<double> evaluate_tail(Interpreter& interpreter) const;
 
     std::string to_string() const
     {
@@ -118,9 +356,24 @@ class FunctionAST
         return this->is_top_level;
     }
 
+    /// The functions the body refers to, each once, in order of first appearance.
+    std::vector<Symbol> collect_callees() const
+    {
+        auto callees = std::vector<Symbol>();
+        this->body->collect_callees(callees);
+        auto seen = std::set<Symbol>();
+        std::erase_if(callees, [&seen](const Symbol callee) { return !seen.insert(callee).second; });
+        return callees;
+    }
+
     std::string_view get_name() const
     {
-        return this->proto->get_name();
+        return this->proto->get_name().str();
+    }
+
+    const PrototypeAST& get_prototype() const
+    {
+        return *this->proto;
     }
 };
 } // namespace ks
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <memory>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "ast.hpp"
+#include "symbol.hpp"
+
+namespace ks
+{
+
+/// Ahead-of-time backend: turns a `CodeGenEnvironment` module into a relocatable object, a static library and a C
+/// header, so the functions can be linked natively without the JIT.
+class ObjectEmitter
+{
+  public:
+    /// Targets the host triple with a generic CPU, so the output runs on any machine of the same architecture.
+    static llvm::Expected<ObjectEmitter> create(
+        llvm::CodeGenOptLevel codegen_opt_level = llvm::CodeGenOptLevel::Default);
+
+    ObjectEmitter(llvm::orc::JITTargetMachineBuilder _builder, std::unique_ptr<llvm::TargetMachine> _target_machine)
+        : builder(std::move(_builder)), target_machine(std::move(_target_machine))
+    {
+    }
+
+    /// Another target machine configured like the emitter's, for target-aware IR optimization.
+    llvm::Expected<std::unique_ptr<llvm::TargetMachine>> create_target_machine()
+    {
+        return this->builder.createTargetMachine();
+    }
+
+    llvm::DataLayout get_data_layout() const
+    {
+        return this->target_machine->createDataLayout();
+    }
+
+    /// Functions whose names are not C identifiers (the operators, for instance) get internal linkage, so that
+    /// objects from different scripts can be linked together. Without `internalize`, every definition stays external,
+    /// for objects that are loaded into the JIT instead.
+    llvm::Expected<llvm::SmallVector<char, 0>> emit_object(llvm::Module& module, bool internalize = true);
+
+    static llvm::Error write_object(llvm::ArrayRef<char> object, llvm::StringRef path);
+    /// Wraps `object` into a single-member archive.
+    llvm::Error write_static_library(llvm::ArrayRef<char> object, llvm::StringRef path) const;
+
+    /// Declares every prototype in `prototypes` whose name is a C identifier. Functions without a body in `module`
+    /// are listed separately, as they have to be provided by the host.
+    static llvm::Error write_c_header(const llvm::Module& module,
+                                      const SymbolMap<std::unique_ptr<PrototypeAST>>& prototypes,
+                                      llvm::StringRef path);
+
+  private:
+    llvm::orc::JITTargetMachineBuilder builder;
+    std::unique_ptr<llvm::TargetMachine> target_machine;
+};
+} // namespace ks
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/Support/Error.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "JITCompiler.hpp"
+#include "ast.hpp"
+#include "environment.hpp"
+#include "optimizer.hpp"
+#include "symbol.hpp"
+
+namespace ks
+{
+
+struct EngineOptions
+{
+    JITOptions jit{};
+    /// Overrides `jit.codegen_opt_level`. Without a level, a few cheap passes run on each function.
+    std::optional<OptLevel> opt_level = std::nullopt;
+    /// The operators compiled ahead of time, usually `prelude_object()`. Empty generates and compiles them instead.
+    std::string_view prelude_object{};
+};
+
+/// How a native parameter type is passed: `d` for a number, `p` and `n` for an array's data and length. The data is
+/// never `const`, as `map` and `zip` write into their output array.
+template <typename T> constexpr char native_parameter_kind()
+{
+    if constexpr (std::is_same_v<T, double>)
+    {
+        return 'd';
+    }
+    else if constexpr (std::is_same_v<T, double*>)
+    {
+        return 'p';
+    }
+    else if constexpr (std::is_same_v<T, std::int64_t>)
+    {
+        return 'n';
+    }
+    else
+    {
+        return '?';
+    }
+}
+
+template <typename Signature> struct NativeSignature
+{
+    static constexpr bool valid = false;
+};
+
+template <typename... Args> struct NativeSignature<double(Args...)>
+{
+    static constexpr bool valid = ((native_parameter_kind<Args>() != '?') && ...);
+    static constexpr std::array<char, sizeof...(Args)> parameters{native_parameter_kind<Args>()...};
+};
+
+/// Prototypes of the functions compiled through an engine, shared by all of its sessions. Readers take a shared lock,
+/// so lookups from many threads do not wait on each other.
+class FunctionRegistry
+{
+  public:
+    /// Copies the prototypes published since `seen` into `into`, skipping names it already has, and advances `seen`.
+    void import(std::size_t& seen, SymbolMap<std::unique_ptr<PrototypeAST>>& into) const;
+
+    std::optional<PrototypeAST> find(Symbol name) const;
+
+    /// Whether `name` was defined, or is being defined, through a session, which makes it impossible to define again.
+    bool is_defined(Symbol name) const;
+
+    /// Atomically marks `definitions` defined, so that no other session can define them too. If one of them is
+    /// already defined, or was published with other parameters than `declared` has for it, e.g. by an extern in
+    /// another session whose callers already pass those, changes nothing and returns it.
+    std::optional<Symbol> claim(std::span<const Symbol> definitions,
+                                const SymbolMap<std::unique_ptr<PrototypeAST>>& declared);
+
+    /// Gives up a claim whose code the JIT did not accept.
+    void release(std::span<const Symbol> definitions);
+
+    /// Publishes the prototypes `declared` has for the claimed `definitions` and for `declarations`, once their code
+    /// is in the JIT, so that other sessions only import functions they can link against.
+    void publish(std::span<const Symbol> declarations, std::span<const Symbol> definitions,
+                 const SymbolMap<std::unique_ptr<PrototypeAST>>& declared);
+
+  private:
+    mutable std::shared_mutex mutex{};
+    SymbolMap<std::unique_ptr<PrototypeAST>> prototypes{};
+    std::set<Symbol> defined{};
+};
+
+class Engine;
+
+/// Compiles source into an engine's JIT with an environment of its own, i.e. its own context, module and builder. A
+/// session is used by one thread at a time; sessions of the same engine compile concurrently, and see each other's
+/// definitions from their next `compile` on.
+class Session
+{
+  public:
+    Session(Engine& _engine, CodeGenEnvironment _env);
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    /// Compiles the definitions and externs of `source`, then runs its top-level expressions and returns their values
+    /// in source order. If any definition fails, none of those in `source` are kept. Every definition taking only
+    /// numbers also gets a batch entry point, see `Engine::lookup_batch`.
+    llvm::Expected<std::vector<double>> compile(std::string_view source);
+
+    CodeGenEnvironment& get_environment()
+    {
+        return this->env;
+    }
+
+  private:
+    Engine& engine;
+    CodeGenEnvironment env;
+    /// How many of the registry's prototypes `env` has imported.
+    std::size_t imported = 0u;
+
+    /// Drops the current module and everything `compile` generated into it.
+    void discard_module(const std::vector<Symbol>& definitions);
+};
+
+/// Compiles source text into a JIT and hands its functions out as native function pointers. Source is parsed and
+/// compiled once; a looked-up pointer calls the generated code directly, without any lock.
+///
+/// `compile` goes through a default session and must not be called concurrently; threads that compile at the same
+/// time each use a session from `create_session`. Lookups are safe from any thread.
+class Engine
+{
+  public:
+    Engine(std::unique_ptr<JITCompiler> _jit_compiler, CodeGenEnvironment _env,
+           const EngineOptions& _options = EngineOptions());
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    /// Creates the JIT and hands the predefined operators to it, linking `options.prelude_object` if there is one.
+    static llvm::Expected<std::unique_ptr<Engine>> create(const EngineOptions& options = EngineOptions());
+
+    /// A session with a fresh environment, optimized like the engine's own. Safe to call from any thread.
+    llvm::Expected<std::unique_ptr<Session>> create_session();
+
+    /// `Session::compile` on the default session.
+    llvm::Expected<std::vector<double>> compile(std::string_view source)
+    {
+        return this->session.compile(source);
+    }
+
+    /// Looks `name` up as a native function, e.g. `lookup<double(double, double)>("f")`. An array parameter is passed
+    /// as `double*` and `std::int64_t`. The signature is checked against the definition once, here.
+    template <typename Signature> llvm::Expected<Signature*> lookup(const std::string_view name)
+    {
+        static_assert(NativeSignature<Signature>::valid,
+                      "compiled functions return a double and take doubles, or pointers and lengths for arrays");
+        constexpr auto& parameters = NativeSignature<Signature>::parameters;
+        auto address = this->lookup_address(name, std::string_view(parameters.data(), parameters.size()));
+        if (!address)
+        {
+            return address.takeError();
+        }
+        return address->template toPtr<Signature*>();
+    }
+
+    /// `f_batch(columns, out, count)` stores `f(columns[0][i], ..., columns[N - 1][i])` to `out[i]` for every
+    /// `i < count`. `count` is signed, like the array lengths in generated code, so a negative one stores nothing.
+    using BatchFunction = void (*)(const double* const* columns, double* out, std::int64_t count);
+
+    /// Looks up the batch entry point generated for `name`, a function taking only numbers defined through `compile`.
+    llvm::Expected<BatchFunction> lookup_batch(std::string_view name);
+
+    JITCompiler& get_jit_compiler()
+    {
+        return *this->jit_compiler;
+    }
+
+    /// The default session's environment.
+    CodeGenEnvironment& get_environment()
+    {
+        return this->session.get_environment();
+    }
+
+  private:
+    friend class Session;
+
+    std::unique_ptr<JITCompiler> jit_compiler;
+    std::optional<OptLevel> opt_level;
+    Statistics* statistics;
+    FunctionRegistry registry{};
+    /// Numbers the top-level expressions of all sessions, which share the JIT's symbol namespace.
+    std::atomic<std::uint64_t> expressions = 0u;
+    Session session;
+
+    llvm::Expected<llvm::orc::ExecutorAddr> lookup_address(std::string_view name, std::string_view parameters);
+};
+} // namespace ks
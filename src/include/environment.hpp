@@ -3,30 +3,30 @@
 #include <format>
 #include <functional>
 #include <iostream>
-#include <map>
 #include <memory>
 
 #if defined(__clang__)
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Weverything"
 #endif
-#include "llvm/Analysis/CGSCCPassManager.h"
-#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
-#include "llvm/IR/PassManager.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Verifier.h"
-#include "llvm/Passes/StandardInstrumentations.h"
 #if defined(__clang__)
 #pragma clang diagnostic pop
 #endif
 
 #include "JITCompiler.hpp"
 #include "ast.hpp"
+#include "optimizer.hpp"
+#include "symbol.hpp"
 
 namespace ks
 {
@@ -36,49 +36,63 @@ class CodeGenEnvironment
     std::unique_ptr<llvm::LLVMContext> context = nullptr;
     std::unique_ptr<llvm::IRBuilder<>> builder = nullptr;
     std::unique_ptr<llvm::Module> module = nullptr;
-    std::unique_ptr<llvm::FunctionPassManager> function_pass_manager = nullptr;
-    std::unique_ptr<llvm::LoopAnalysisManager> loop_analysis_manager = nullptr;
-    std::unique_ptr<llvm::FunctionAnalysisManager> function_analysis_manager = nullptr;
-    std::unique_ptr<llvm::CGSCCAnalysisManager> cgscc_analysis_manager = nullptr;
-    std::unique_ptr<llvm::ModuleAnalysisManager> module_analysis_manager = nullptr;
-    std::unique_ptr<llvm::PassInstrumentationCallbacks> pass_instrumentation_callbacks = nullptr;
-    std::unique_ptr<llvm::StandardInstrumentations> standard_instrumentations = nullptr;
-    std::map<std::string, llvm::Value*> named_values{};
-    std::map<std::string, std::unique_ptr<PrototypeAST>> function_prototypes{};
+    std::unique_ptr<OptimizationPipeline> optimizer = nullptr;
+    SymbolMap<llvm::Value*> named_values{};
+    SymbolMap<ArrayValue> named_arrays{};
+    SymbolMap<std::unique_ptr<PrototypeAST>> function_prototypes{};
+    /// Small definitions from modules that were already handed off, kept to be re-emitted into later modules. Shared,
+    /// as whoever recompiles a definition keeps its AST too.
+    SymbolMap<std::shared_ptr<FunctionAST>> inlinable_functions{};
 
-    explicit CodeGenEnvironment(llvm::DataLayout layout);
+    /// Leave all optimization to the JIT, which runs its own pipeline on each function it compiles. Set for a lazy
+    /// JIT, so that functions that are never called are never optimized either.
+    bool defer_optimization = false;
 
-    static CodeGenEnvironment predefined_operators(llvm::DataLayout layout);
+    /// Definitions of at most this many instructions (after optimization) are retained for cross-module inlining.
+    static constexpr unsigned max_inline_instructions = 32u;
 
-    void initialize_module_and_managers(llvm::DataLayout layout);
+    /// Without an `optimizer`, the default per-function pipeline is used.
+    explicit CodeGenEnvironment(llvm::DataLayout layout, std::unique_ptr<OptimizationPipeline> _optimizer = nullptr);
 
-    llvm::orc::ResourceTrackerSP add_to_jit_compiler(JITCompiler& jit_compiler, bool resource_tracking = false);
+    static CodeGenEnvironment predefined_operators(llvm::DataLayout layout,
+                                                   std::unique_ptr<OptimizationPipeline> optimizer = nullptr);
 
-    template <std::ranges::range Args> llvm::Function* gen_prototype(const std::string_view name, const Args& args)
-    {
-        const auto nargs = std::ranges::size(args);
-        const auto doubles = std::vector<llvm::Type*>(nargs, llvm::Type::getDoubleTy(*this->context));
-        const auto ty = llvm::FunctionType::get(llvm::Type::getDoubleTy(*this->context), std::move(doubles), false);
-        const auto fun = llvm::Function::Create(ty, llvm::Function::ExternalLinkage, name, this->module.get());
+    /// Only declares the operators, for a JIT that already has their definitions, e.g. from the prebuilt prelude.
+    static CodeGenEnvironment declared_operators(llvm::DataLayout layout,
+                                                 std::unique_ptr<OptimizationPipeline> optimizer = nullptr);
 
-        auto idx = std::size_t(0);
-        for (auto& arg : fun->args())
-        {
-            arg.setName(args[idx++]);
-        }
+    void initialize_module(llvm::DataLayout layout);
+
+    /// Imports inlinable definitions and runs the per-module pipeline; with `defer_optimization`, only inlines the
+    /// imported definitions. `add_to_jit_compiler` does this itself; call it directly before emitting the module any
+    /// other way.
+    void finalize_module();
+
+    /// Finalizes the module and returns it with its context, starting a new one, e.g. to add it to the JIT later.
+    llvm::orc::ThreadSafeModule take_module(llvm::DataLayout layout);
+
+    /// Hands the module to the JIT and starts a new one. Fails if the JIT rejects the module, e.g. because it defines
+    /// a name that is already defined; its code is discarded then.
+    llvm::Expected<llvm::orc::ResourceTrackerSP> add_to_jit_compiler(JITCompiler& jit_compiler,
+                                                                     bool resource_tracking = false);
+
+    template <std::ranges::range Args> llvm::Function* gen_prototype(const Symbol name, const Args& args)
+    {
+        const auto fun = llvm::Function::Create(this->gen_function_type(args), llvm::Function::ExternalLinkage,
+                                                name.str(), this->module.get());
+        name_parameters(*fun, args);
 
-        const auto name_str = std::string(name);
-        this->function_prototypes[name_str] =
-            std::make_unique<PrototypeAST>(name_str, std::vector<std::string>(args.begin(), args.end()));
+        this->function_prototypes[name] =
+            std::make_unique<PrototypeAST>(name, std::vector<Symbol>(args.begin(), args.end()));
 
         return fun;
     }
 
     template <std::ranges::range Args>
-    llvm::Function* gen_function(const std::string_view name, const Args& args,
+    llvm::Function* gen_function(const Symbol name, const Args& args,
                                  std::function<llvm::Value*(CodeGenEnvironment&)> body)
     {
-        auto fun = this->module->getFunction(name);
+        auto fun = this->module->getFunction(name.str());
         if (fun == nullptr)
         {
             fun = this->gen_prototype(name, args);
@@ -95,20 +109,41 @@ class CodeGenEnvironment
             return nullptr;
         }
 
+        if (fun->getFunctionType() != this->gen_function_type(args))
+        {
+            LogError(std::format("Function `{}` was declared with a different signature", name));
+            return nullptr;
+        }
+
         auto bb = llvm::BasicBlock::Create(*this->context, "entry", fun);
         this->builder->SetInsertPoint(bb);
 
+        name_parameters(*fun, args);
         this->named_values.clear();
-        for (auto& arg : fun->args())
+        this->named_arrays.clear();
+        auto param = fun->arg_begin();
+        for (const auto arg : args)
         {
-            this->named_values[std::string(arg.getName())] = &arg;
+            if (is_array_name(arg))
+            {
+                const auto data = &*param++;
+                this->named_arrays[arg] = ArrayValue{data, &*param++};
+            }
+            else
+            {
+                this->named_values[arg] = &*param++;
+            }
         }
 
         if (auto retval = body(*this))
         {
             this->builder->CreateRet(retval);
+            mark_tail_calls(*fun);
             llvm::verifyFunction(*fun);
-            this->function_pass_manager->run(*fun, *this->function_analysis_manager);
+            if (!this->defer_optimization)
+            {
+                this->optimizer->run(*fun);
+            }
 
             return fun;
         }
@@ -117,10 +152,79 @@ class CodeGenEnvironment
         return nullptr;
     }
 
-    llvm::Function* get_function(const std::string_view name);
+    llvm::Function* get_function(const Symbol name);
+
+    /// Calls a built-in operator or a function taking only numbers.
+    llvm::Value* gen_apply(const Symbol fun, llvm::ArrayRef<llvm::Value*> operands);
+
+    /// Emits `for (i = 0; i < count; ++i) acc = body(i, acc);` with `acc` starting at `init`, and returns the final
+    /// `acc`. `count` is a signed `i64`; the loop is in the canonical form the loop vectorizer expects.
+    llvm::Value* gen_loop(llvm::Value* count, llvm::Value* init,
+                          llvm::function_ref<llvm::Value*(llvm::Value* index, llvm::Value* acc)> body);
+
+    /// Emits `void <name>_batch(const double* const* columns, double* out, i64 count)`, which stores `name` applied
+    /// to each row of `columns` to `out`. The call is inlined when `name` is defined in the current module, so the
+    /// loop can be vectorized by a module pipeline.
+    llvm::Function* gen_batch_function(const Symbol name);
+
+    static bool is_operator(const Symbol name);
+
+    /// Emits a predefined operator inline; the builder folds constant operands.
+    llvm::Value* gen_operator(const Symbol op, llvm::Value* lhs, llvm::Value* rhs);
+
+    /// Keeps `fun` for inlining into later modules if its definition in the current module is small enough. Must be
+    /// called before the module is handed off.
+    void retain_for_inlining(std::shared_ptr<FunctionAST> fun);
 
   private:
     void register_operators();
+    void declare_operators();
+
+    /// Every parameter is a `double`, except that an array is passed as a pointer and an `i64` length.
+    template <std::ranges::range Args> llvm::FunctionType* gen_function_type(const Args& args)
+    {
+        auto params = std::vector<llvm::Type*>();
+        for (const auto arg : args)
+        {
+            if (is_array_name(arg))
+            {
+                params.push_back(this->builder->getPtrTy());
+                params.push_back(this->builder->getInt64Ty());
+            }
+            else
+            {
+                params.push_back(this->builder->getDoubleTy());
+            }
+        }
+        return llvm::FunctionType::get(this->builder->getDoubleTy(), params, false);
+    }
+
+    template <std::ranges::range Args> static void name_parameters(llvm::Function& fun, const Args& args)
+    {
+        auto param = fun.arg_begin();
+        for (const auto arg : args)
+        {
+            if (is_array_name(arg))
+            {
+                const auto base = arg.str().substr(0u, arg.str().size() - 2u);
+                (param++)->setName(std::format("{}.data", base));
+                (param++)->setName(std::format("{}.len", base));
+            }
+            else
+            {
+                (param++)->setName(arg.str());
+            }
+        }
+    }
+
+    /// Returns from each branch of an `if` in tail position directly, and marks the calls that end up right before a
+    /// `ret` as `musttail` when the callee has the caller's signature (so the backend has to emit a jump) and as
+    /// `tail` otherwise.
+    static void mark_tail_calls(llvm::Function& fun);
+
+    /// Fills declarations of retained functions with `available_externally` `alwaysinline` copies of their bodies.
+    /// Returns whether anything was emitted.
+    bool import_inlinable_functions();
 
     static llvm::Value* LogError(const std::string_view str)
     {
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/Error.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "JITCompiler.hpp"
+#include "ast.hpp"
+#include "environment.hpp"
+#include "symbol.hpp"
+#include "versioned_stubs.hpp"
+
+namespace ks
+{
+
+/// Defines each function `f` as an indirect stub to its latest version `f.v<N>`, so that it can be redefined while
+/// it runs. A redefinition is compiled on a background thread and the stub is then repointed in one store; callers
+/// keep calling the stub and are never recompiled, and calls already inside the old version finish there.
+///
+/// Every version counts the calls inside it. A replaced version is retired, not freed: a thread may have read the
+/// stub just before the swap and not yet entered the old version, or may have just decremented the count on its way
+/// out, and nothing short of a quiescent point tells when it is past those instructions. Retired versions are only
+/// freed by `collect`, and otherwise stay loaded until the JIT is destroyed.
+class HotSwapper
+{
+  public:
+    HotSwapper(JITCompiler& _jit_compiler, std::unique_ptr<llvm::orc::IndirectStubsManager> _stubs);
+
+    /// Fails if the target has no indirect stubs.
+    static llvm::Expected<std::unique_ptr<HotSwapper>> create(JITCompiler& jit_compiler);
+
+    HotSwapper(const HotSwapper&) = delete;
+    HotSwapper& operator=(const HotSwapper&) = delete;
+
+    /// Takes ownership of a definition. The first one of a name is compiled before this returns; a redefinition
+    /// must keep the parameters, and is only queued for the background thread.
+    bool define(std::unique_ptr<FunctionAST> fun);
+
+    /// Makes a function provided by the host callable from later definitions.
+    void declare(const PrototypeAST& proto);
+
+    /// Blocks until every redefinition queued so far has been compiled and swapped in, or has failed. Returns whether
+    /// all of those queued since the last call were swapped in.
+    bool wait_until_swapped();
+
+    /// Frees the retired versions that no call is inside. Must be called at a quiescent point: while no other thread
+    /// runs JIT'd code, e.g. between two calls of the only thread that does. It may be called from a host function
+    /// that JIT'd code called; the versions still on the stack then have calls inside them and are kept.
+    void collect();
+
+    std::size_t count_swapped_functions() const
+    {
+        return this->swapped.load();
+    }
+
+    std::size_t count_freed_versions() const
+    {
+        return this->freed.load();
+    }
+
+  private:
+    struct Version
+    {
+        VersionedStubs::CompiledVersion code{};
+        /// Calls currently inside the version; updated atomically by its code.
+        std::unique_ptr<std::int64_t> active = nullptr;
+    };
+
+    struct SwappableFunction
+    {
+        Version current{};
+        unsigned versions = 0u;
+    };
+
+    struct Redefinition
+    {
+        Symbol name;
+        std::unique_ptr<FunctionAST> ast;
+    };
+
+    /// Guards everything below it; definitions arrive on the caller's thread and are swapped in by the worker.
+    std::mutex mutex{};
+    SymbolMap<SwappableFunction> functions{};
+    /// Replaced versions, kept until `collect` finds no call inside them.
+    std::vector<Version> retired{};
+    std::atomic<std::size_t> swapped = 0u;
+    std::atomic<std::size_t> freed = 0u;
+    /// Redefinitions that failed since the last `wait_until_swapped`.
+    std::atomic<std::size_t> failed = 0u;
+    /// Last, so that its thread stops before the rest goes away.
+    VersionedStubs versions;
+
+    void swap(Redefinition redefinition);
+
+    /// Generates `name` as `name.v<version>`, counting its active calls, and compiles it.
+    std::optional<Version> compile(Symbol name, FunctionAST& ast, unsigned version);
+
+    /// Increments `*active` on entry to `fun` and decrements it right before each return, or before the `musttail`
+    /// call that precedes it: that call must stay a tail call, and no code of this version runs after it.
+    static void count_active_calls(llvm::Function& fun, std::int64_t* active);
+};
+} // namespace ks
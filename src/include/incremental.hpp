@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <set>
+#include <string_view>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "JITCompiler.hpp"
+#include "ast.hpp"
+#include "environment.hpp"
+#include "symbol.hpp"
+
+namespace ks
+{
+
+/// Which functions call which, from the callees of their ASTs.
+class DependencyGraph
+{
+  public:
+    /// Replaces the callees recorded for `caller`.
+    void set_callees(Symbol caller, std::vector<Symbol> callees);
+
+    /// `name` and every function that calls it, directly or through others. Each comes after those of its callees
+    /// that are in the list too, except within a cycle of mutually recursive functions.
+    std::vector<Symbol> collect_dependents(Symbol name) const;
+
+  private:
+    SymbolMap<std::vector<Symbol>> callees{};
+    SymbolMap<std::set<Symbol>> callers{};
+
+    void order_callees_first(Symbol name, const std::set<Symbol>& members, std::set<Symbol>& visited,
+                             std::vector<Symbol>& ordered) const;
+};
+
+/// Compiles each definition into a module with a `ResourceTracker` of its own, so that functions can be redefined.
+/// Redefining `f` removes the code of `f` and of every function that calls it, directly or through others, and
+/// compiles them again from their ASTs: calls are bound to their target's address at link time and may have been
+/// inlined, so none of those callers can keep running against the new `f`. All other code stays live.
+class IncrementalCompiler
+{
+  public:
+    IncrementalCompiler(JITCompiler& _jit_compiler, CodeGenEnvironment& _env)
+        : jit_compiler(_jit_compiler), env(_env)
+    {
+    }
+
+    /// Takes ownership of a definition and compiles it. A redefinition must keep the parameters of the function it
+    /// replaces; if it or one of the callers to recompile fails to compile, the earlier definition stays in place.
+    bool define(std::unique_ptr<FunctionAST> fun);
+
+    /// Callers compiled again because a function they depend on was redefined.
+    std::size_t count_recompiled_functions() const
+    {
+        return this->recompiled;
+    }
+
+  private:
+    struct Definition
+    {
+        std::shared_ptr<FunctionAST> ast = nullptr;
+        llvm::orc::ResourceTrackerSP resource_tracker = nullptr;
+    };
+
+    JITCompiler& jit_compiler;
+    CodeGenEnvironment& env;
+    SymbolMap<Definition> definitions{};
+    DependencyGraph graph{};
+    std::size_t recompiled = 0u;
+
+    /// Keeps the freshly generated `name` for inlining, hands its module to the JIT and records what it calls.
+    bool hand_off(Symbol name);
+
+    static bool LogError(std::string_view str);
+};
+} // namespace ks
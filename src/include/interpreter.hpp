@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ADT/SmallVector.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "JITCompiler.hpp"
+#include "ast.hpp"
+#include "environment.hpp"
+#include "symbol.hpp"
+
+namespace ks
+{
+
+/// Runs code by walking its AST, so cold code starts without waiting for the JIT. Every call of a defined function is
+/// counted; once a function has been called `hot_threshold` times it is generated into the environment together with
+/// the definitions it calls that are still interpreted, and handed to the JIT. The lookup completes in the background
+/// and calls switch to the native code as soon as its address is published.
+class Interpreter
+{
+  public:
+    /// Natively compiled functions are called through a plain function pointer, so only small arities are supported.
+    static constexpr std::size_t max_native_arity = 6u;
+
+    Interpreter(JITCompiler& _jit_compiler, CodeGenEnvironment& _env, std::uint64_t _hot_threshold)
+        : jit_compiler(_jit_compiler), env(_env), hot_threshold(_hot_threshold)
+    {
+    }
+
+    Interpreter(const Interpreter&) = delete;
+    Interpreter& operator=(const Interpreter&) = delete;
+
+    /// Takes ownership of a definition; its AST (and arena) stays alive for as long as the interpreter.
+    bool define(std::unique_ptr<FunctionAST> fun);
+
+    /// Declares a function provided by the host. It is resolved through the JIT on its first call.
+    bool declare(const PrototypeAST& proto);
+
+    /// Evaluates a top-level expression.
+    std::optional<double> run(const FunctionAST& fun);
+
+    std::optional<double> lookup_variable(Symbol name) const;
+
+    /// Tail calls requested by the callee's body are made from here in a loop, so tail recursion runs in constant
+    /// stack.
+    std::optional<double> call(Symbol callee, std::span<const double> args);
+
+    /// Records a call in tail position for the enclosing `call` to make. The returned value is only a placeholder.
+    std::optional<double> request_tail_call(Symbol callee, std::span<const double> args);
+
+    std::size_t count_compiled_functions() const
+    {
+        return this->compiled_functions->load();
+    }
+
+  private:
+    /// Written by the thread that finishes the lookup, read by the interpreter; shared so that a lookup completing
+    /// after the interpreter is gone does not write to freed memory.
+    using NativeAddress = std::shared_ptr<std::atomic<std::uint64_t>>;
+
+    struct TieredFunction
+    {
+        /// Null for externs.
+        std::unique_ptr<FunctionAST> ast = nullptr;
+        std::size_t arity = 0u;
+        bool takes_arrays = false;
+        std::uint64_t calls = 0u;
+        bool handed_to_jit = false;
+        NativeAddress native = nullptr;
+    };
+
+    struct TailCall
+    {
+        Symbol callee;
+        llvm::SmallVector<double, 8> args;
+    };
+
+    struct Frame
+    {
+        std::span<const Symbol> params;
+        std::span<const double> args;
+    };
+
+    JITCompiler& jit_compiler;
+    CodeGenEnvironment& env;
+    std::uint64_t hot_threshold;
+    SymbolMap<TieredFunction> functions{};
+    std::vector<Frame> frames{};
+    std::optional<TailCall> pending_tail_call = std::nullopt;
+    std::shared_ptr<std::atomic<std::size_t>> compiled_functions = std::make_shared<std::atomic<std::size_t>>(0u);
+
+    std::optional<double> call_once(Symbol callee, std::span<const double> args);
+    void compile(Symbol name);
+
+    static std::optional<double> LogError(std::string_view str);
+};
+} // namespace ks
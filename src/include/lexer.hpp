@@ -4,7 +4,22 @@
 #include <format>
 #include <iostream>
 #include <istream>
+#include <memory>
 #include <string>
+#include <string_view>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "symbol.hpp"
 
 namespace ks
 {
@@ -14,17 +29,25 @@ enum TokenType
     END_OF_FILE,
     DEF,
     EXTERN,
+    IF,
     IDENTIFIER,
+    NUMBER,
     LEFT_PAREN,
     RIGHT_PAREN,
 };
 
+/// `str` is a slice of the lexer's buffer. For stream input it stays valid until the next `get_token` call; for
+/// file and memory input it lives as long as the lexer. Identifiers are interned into `symbol` and numbers parsed into
+/// `number` as they are lexed.
 struct Token
 {
-    std::string str;
+    std::string_view str;
+    Symbol symbol;
+    double number;
     TokenType ty;
 
-    Token(TokenType _ty, std::string _str = "") : str(_str), ty(_ty)
+    Token(TokenType _ty, std::string_view _str = {}, Symbol _symbol = {}, double _number = 0.0)
+        : str(_str), symbol(_symbol), number(_number), ty(_ty)
     {
     }
 };
@@ -32,26 +55,39 @@ struct Token
 class Lexer
 {
   public:
-    explicit Lexer(std::istream& _is) : is(_is)
+    /// Reads the stream in line-sized chunks, so interactive input is still lexed as soon as a line is entered.
+    explicit Lexer(std::istream& _is) : is(&_is)
+    {
+    }
+    /// Lexes the buffer in place, without copying it.
+    explicit Lexer(std::unique_ptr<llvm::MemoryBuffer> _source) : source(std::move(_source))
     {
-        this->is >> std::noskipws;
     }
+
+    /// Memory-maps `path` (or reads it, for small files) and lexes it in place.
+    static llvm::Expected<Lexer> from_file(llvm::StringRef path);
+
     Token get_token();
 
   private:
-    std::istream& is;
-    char last_char = ' ';
+    static constexpr std::size_t chunk_size = 64u * 1024u;
 
-    char getchar()
+    std::istream* is = nullptr;
+    std::unique_ptr<llvm::MemoryBuffer> source = nullptr;
+    std::string chunk{};
+    std::string line{};
+    std::size_t pos = 0u;
+
+    std::string_view buffer() const
     {
-        if (this->is.eof())
+        if (this->source)
         {
-            return EOF;
+            return std::string_view(this->source->getBufferStart(), this->source->getBufferSize());
         }
-        char c;
-        this->is >> c;
-        return c;
+        return this->chunk;
     }
+
+    bool refill();
 };
 
 } // namespace ks
@@ -69,10 +105,13 @@ template <> struct std::formatter<ks::Token> : std::formatter<std::string>
                 TOKEN_TO_STRING(END_OF_FILE)
                 TOKEN_TO_STRING(DEF)
                 TOKEN_TO_STRING(EXTERN)
+                TOKEN_TO_STRING(IF)
                 TOKEN_TO_STRING(LEFT_PAREN)
                 TOKEN_TO_STRING(RIGHT_PAREN)
             case ks::TokenType::IDENTIFIER:
                 return std::format("IDENTIFIER({})", t.str);
+            case ks::TokenType::NUMBER:
+                return std::format("NUMBER({})", t.number);
             }
 #undef TOKEN_TO_STRING
             assert(false);
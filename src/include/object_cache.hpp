@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+/// On-disk cache of emitted objects. An object is stored under a hash of the module's IR together with
+/// `target_key`, which has to capture everything else that changes codegen (triple, CPU, features, opt level).
+class ObjectCache : public llvm::ObjectCache
+{
+  public:
+    /// Creates `directory` if needed.
+    static llvm::Expected<std::unique_ptr<ObjectCache>> create(std::string directory, std::string target_key);
+
+    ObjectCache(std::string _directory, std::string _target_key)
+        : directory(std::move(_directory)), target_key(std::move(_target_key))
+    {
+    }
+
+    void notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* module) override;
+
+    std::size_t count_hits() const
+    {
+        return this->hits.load();
+    }
+    std::size_t count_misses() const
+    {
+        return this->misses.load();
+    }
+
+  private:
+    std::string directory;
+    std::string target_key;
+    std::atomic<std::size_t> hits = 0u;
+    std::atomic<std::size_t> misses = 0u;
+    // Paths computed by a missed `getObject`, so `notifyObjectCompiled` does not hash the module a second time.
+    std::mutex pending_mutex{};
+    std::unordered_map<const llvm::Module*, std::string> pending_paths{};
+
+    std::string object_path(const llvm::Module& module) const;
+};
+} // namespace ks
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Target/TargetMachine.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#include "statistics.hpp"
+
+namespace ks
+{
+
+/// An `-O` level: LLVM's default pipeline to run on each module, and the matching codegen level.
+struct OptLevel
+{
+    llvm::OptimizationLevel ir;
+    llvm::CodeGenOptLevel codegen;
+};
+
+/// The optimization pipeline and its analysis managers. It does not depend on any `LLVMContext`, so one instance is
+/// built per session and reused for every module.
+class OptimizationPipeline
+{
+  public:
+    /// A few cheap passes on each function as soon as it is generated.
+    OptimizationPipeline();
+    /// LLVM's default per-module pipeline for `level`, run once per module before hand-off, tuned for
+    /// `target_machine`.
+    OptimizationPipeline(llvm::OptimizationLevel level, std::unique_ptr<llvm::TargetMachine> target_machine);
+
+    OptimizationPipeline(const OptimizationPipeline&) = delete;
+    OptimizationPipeline& operator=(const OptimizationPipeline&) = delete;
+
+    void run(llvm::Function& fun);
+
+    /// Runs the per-module pipeline. Without an `-O` level, that only inlines `alwaysinline` callees and cleans the
+    /// callers up again.
+    void run(llvm::Module& module);
+
+    /// Only inlines `alwaysinline` callees, for a module whose other passes run later.
+    void run_inliner(llvm::Module& module);
+
+    /// Whether `run(llvm::Module&)` is worth calling on a module without `alwaysinline` functions.
+    bool has_module_pipeline() const
+    {
+        return this->level.has_value();
+    }
+
+    /// Null unless an `-O` level was given.
+    const llvm::TargetMachine* get_target_machine() const
+    {
+        return this->target_machine.get();
+    }
+
+    /// Runs the per-function passes on every definition in `module`, then the per-module pipeline, and drops the
+    /// analyses again; for a module that was generated without being optimized, e.g. one the lazy JIT compiles.
+    void optimize(llvm::Module& module);
+
+    /// Drops every cached analysis result. Results are keyed by IR unit, so they must go before the module they
+    /// describe is handed to the JIT and destroyed.
+    void reset();
+
+    llvm::PassInstrumentationCallbacks& get_instrumentation_callbacks()
+    {
+        return this->pass_instrumentation_callbacks;
+    }
+
+    /// Not owned. Each pass shows up in the time trace regardless.
+    void set_statistics(Statistics* _statistics)
+    {
+        this->statistics = _statistics;
+    }
+
+  private:
+    std::unique_ptr<llvm::TargetMachine> target_machine = nullptr;
+    llvm::PassInstrumentationCallbacks pass_instrumentation_callbacks{};
+    llvm::TimeProfilingPassesHandler time_profiling_passes{};
+    Statistics* statistics = nullptr;
+    llvm::PassBuilder pass_builder;
+    std::optional<llvm::OptimizationLevel> level = std::nullopt;
+    // Declared in this order so that they are destroyed in the reverse one, as the proxies between them require.
+    llvm::LoopAnalysisManager loop_analysis_manager{};
+    llvm::FunctionAnalysisManager function_analysis_manager{};
+    llvm::CGSCCAnalysisManager cgscc_analysis_manager{};
+    llvm::ModuleAnalysisManager module_analysis_manager{};
+    llvm::FunctionPassManager function_pass_manager{};
+    llvm::ModulePassManager module_pass_manager{};
+    llvm::ModulePassManager inliner_pass_manager{};
+
+    void register_analyses();
+};
+} // namespace ks
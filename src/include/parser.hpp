@@ -2,6 +2,8 @@
 
 #include <memory>
 #include <optional>
+#include <set>
+#include <span>
 #include <variant>
 
 #include "ast.hpp"
@@ -14,25 +16,47 @@ class Parser
 {
   public:
     using ParseResult = std::variant<std::unique_ptr<PrototypeAST>, std::unique_ptr<FunctionAST>>;
-    Parser(Lexer&& _lexer) : lexer(std::move(_lexer))
+    /// With `_echo`, every parsed form is printed to stdout.
+    Parser(Lexer&& _lexer, bool _echo = true) : lexer(std::move(_lexer)), echo(_echo)
     {
     }
     std::optional<ParseResult> parse_top_level();
 
+    /// Whether `parse_top_level` stopped at the end of the input rather than at an error.
+    bool reached_end_of_input() const
+    {
+        return this->reached_end;
+    }
+
+    /// Makes `(name ...)` parse as a call even if `name` is an array form like `map`, as it does once a declaration or
+    /// definition of `name` has been parsed; for functions declared before this parser was created.
+    void declare_function(const Symbol name)
+    {
+        this->functions.insert(name);
+    }
+
   private:
     Token current_token = Token(TokenType::END_OF_FILE);
     Lexer lexer;
+    bool echo;
+    bool reached_end = false;
     std::size_t annon = 0u;
+    /// Names of the functions declared so far, which take precedence over the array forms.
+    std::set<Symbol> functions{};
+    std::unique_ptr<ASTArena> arena = nullptr;
 
     Token get_next_token();
     std::unique_ptr<PrototypeAST> gen_annon_expr();
-    std::unique_ptr<ExprAST> parse_expression();
-    std::optional<std::vector<std::unique_ptr<ExprAST>>> parse_args();
-    std::unique_ptr<ExprAST> parse_call_expression();
+    ExprAST* parse_expression();
+    std::optional<std::span<ExprAST*>> parse_args();
+    ExprAST* parse_call_expression();
+    ExprAST* parse_if_expression();
+    ExprAST* parse_array_expression();
+    ExprAST* parse_list_expression();
     std::unique_ptr<PrototypeAST> parse_prototype();
     std::unique_ptr<FunctionAST> parse_define();
     std::unique_ptr<PrototypeAST> parse_extern();
     std::unique_ptr<FunctionAST> parse_top_level_expr();
-    std::unique_ptr<FunctionAST> parse_top_level_identifier();
+    std::unique_ptr<FunctionAST> parse_top_level_atom();
 };
 } // namespace ks
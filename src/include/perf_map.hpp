@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Error.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+/// Keeps `/tmp/perf-<pid>.map` listing every function of the loaded objects, so that `perf report` can name samples
+/// in JIT'd code. Loading an object appends its functions. Freeing one, e.g. when its `ResourceTracker` is removed,
+/// writes nothing: its entries stay valid for the samples taken while it was loaded. Only when a later object is
+/// loaded over a freed address range is the file rewritten without the freed entries, since perf reads the whole map
+/// and cannot tell which of two overlapping entries is current. The map therefore also survives the session's end.
+class PerfMapListener final : public llvm::JITEventListener
+{
+  public:
+    explicit PerfMapListener(std::string _path) : path(std::move(_path))
+    {
+    }
+
+    /// Creates the map file of this process, truncating a stale one left by an earlier process with the same pid.
+    static llvm::Expected<std::unique_ptr<PerfMapListener>> create();
+
+    void notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile& object,
+                            const llvm::RuntimeDyld::LoadedObjectInfo& info) override;
+
+    void notifyFreeingObject(ObjectKey key) override;
+
+    const std::string& get_path() const
+    {
+        return this->path;
+    }
+
+  private:
+    struct Entry
+    {
+        std::uint64_t address;
+        std::uint64_t size;
+        std::string name;
+    };
+
+    std::mutex mutex{};
+    std::string path;
+    std::map<ObjectKey, std::vector<Entry>> entries{};
+    /// Entries of freed objects that are still in the file.
+    std::vector<Entry> freed{};
+
+    /// Whether one of `loaded` overlaps a freed entry. Must be called with `mutex` held.
+    bool reuses_freed_range(const std::vector<Entry>& loaded) const;
+
+    /// Both must be called with `mutex` held.
+    llvm::Error append(const std::vector<Entry>& loaded) const;
+    llvm::Error rewrite() const;
+};
+} // namespace ks
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string_view>
+
+namespace ks
+{
+
+/// The predefined operators as a relocatable object for the build host's architecture, compiled by
+/// `kaleidoscope_prelude_gen` when the project is built. Defined in the generated `prelude_object.cpp`, which only the
+/// `kaleidoscope_prelude` library provides; pass it as `EngineOptions::prelude_object`.
+std::string_view prelude_object();
+} // namespace ks
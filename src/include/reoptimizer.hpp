@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/Support/Error.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "JITCompiler.hpp"
+#include "ast.hpp"
+#include "environment.hpp"
+#include "symbol.hpp"
+#include "versioned_stubs.hpp"
+
+namespace ks
+{
+
+/// Compiles each definition `f` first as `f.v0`, instrumented to count its calls and which way each conditional
+/// branch and select goes, and defines `f` as an indirect stub to it. When `f` has been called `hot_threshold` times,
+/// a background thread generates `f.v1` from the same AST with the counts attached as branch weights and entry count,
+/// imports the bodies of the profiled functions it calls so they can be inlined, optimizes the module at -O3 and
+/// points the stub at the result.
+class Reoptimizer
+{
+  public:
+    Reoptimizer(JITCompiler& _jit_compiler, std::unique_ptr<llvm::orc::IndirectStubsManager> _stubs,
+                std::uint64_t _hot_threshold);
+
+    /// Fails if the target has no indirect stubs.
+    static llvm::Expected<std::unique_ptr<Reoptimizer>> create(JITCompiler& jit_compiler, std::uint64_t hot_threshold);
+
+    Reoptimizer(const Reoptimizer&) = delete;
+    Reoptimizer& operator=(const Reoptimizer&) = delete;
+
+    /// Takes ownership of a definition and compiles its instrumented version. On failure nothing of it is left behind.
+    bool define(std::unique_ptr<FunctionAST> fun);
+
+    /// Makes a function provided by the host callable from later definitions.
+    void declare(const PrototypeAST& proto);
+
+    std::size_t count_reoptimized_functions() const
+    {
+        return this->reoptimized.load();
+    }
+
+  private:
+    struct ProfiledFunction
+    {
+        std::unique_ptr<FunctionAST> ast = nullptr;
+        /// `counts[0]` is the number of calls; `counts[1 + 2 * k]` and `counts[2 + 2 * k]` are how often the `k`-th
+        /// branch site went to its true and false side. Updated atomically by the instrumented code.
+        std::unique_ptr<std::uint64_t[]> counts = nullptr;
+        std::size_t sites = 0u;
+        unsigned version = 0u;
+    };
+
+    JITCompiler& jit_compiler;
+    std::uint64_t hot_threshold;
+    /// Guards everything below it; definitions arrive on the main thread and are read by the worker.
+    std::mutex mutex{};
+    SymbolMap<ProfiledFunction> functions{};
+    /// Indexed by the id the instrumented code passes to `request_reoptimization`.
+    std::vector<Symbol> ids{};
+    std::atomic<std::size_t> reoptimized = 0u;
+    /// Last, so that its thread stops before the rest goes away.
+    VersionedStubs versions;
+
+    /// Called by instrumented code, on whichever thread runs it, when a function becomes hot.
+    static void request_reoptimization(Reoptimizer* self, std::uint32_t id);
+
+    void reoptimize(Symbol name);
+
+    /// The conditional branches and selects of `fun`, in layout order.
+    static std::vector<llvm::Instruction*> find_branch_sites(llvm::Function& fun);
+
+    void instrument(llvm::Function& fun, std::span<llvm::Instruction* const> sites, std::uint64_t* counts,
+                    std::uint32_t id) const;
+
+    static void attach_profile(llvm::Function& fun, std::span<const std::uint64_t> counts);
+
+    /// Reads the counters of `name` while the instrumented code may still be updating them. Empty if `name` is not
+    /// profiled. Must be called with `mutex` held.
+    std::vector<std::uint64_t> snapshot_counts(Symbol name);
+};
+} // namespace ks
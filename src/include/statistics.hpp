@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+enum class Phase : std::uint8_t
+{
+    PARSE,
+    IR_GENERATION,
+    OPTIMIZATION,
+    EMISSION,
+    LINKING,
+    LOOKUP,
+};
+
+/// Wall time per phase, module and instruction counts, and emitted code bytes per function. Phases nest: IR
+/// generation includes the per-function passes, and a lookup includes whatever it materializes on the calling thread.
+/// Compile threads update it too, so every member is guarded by `mutex`.
+class Statistics
+{
+  public:
+    /// Times the enclosing scope as `phase` in `statistics`, if not null, and as a time-trace entry if the profiler
+    /// is enabled.
+    class Scope
+    {
+      public:
+        Scope(Statistics* _statistics, Phase _phase, llvm::StringRef detail = "")
+            : statistics(_statistics), phase(_phase), start(Clock::now()), trace(phase_name(_phase), detail)
+        {
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope()
+        {
+            if (this->statistics != nullptr)
+            {
+                this->statistics->add_time(this->phase, Clock::now() - this->start);
+            }
+        }
+
+      private:
+        Statistics* statistics;
+        Phase phase;
+        std::chrono::steady_clock::time_point start;
+        llvm::TimeTraceScope trace;
+    };
+
+    static llvm::StringRef phase_name(Phase phase);
+
+    void add_module(std::size_t functions, std::size_t instructions);
+    void add_code_size(llvm::StringRef function, std::uint64_t bytes);
+
+    void print(llvm::raw_ostream& os) const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::size_t phase_count = static_cast<std::size_t>(Phase::LOOKUP) + 1u;
+
+    struct PhaseTotal
+    {
+        Clock::duration time = Clock::duration::zero();
+        std::uint64_t count = 0u;
+    };
+
+    mutable std::mutex mutex{};
+    std::array<PhaseTotal, phase_count> phases{};
+    std::uint64_t modules = 0u;
+    std::uint64_t functions = 0u;
+    std::uint64_t instructions = 0u;
+    std::vector<std::pair<std::string, std::uint64_t>> code_sizes{};
+
+    void add_time(Phase phase, Clock::duration time);
+};
+} // namespace ks
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <compare>
+#include <cstdint>
+#include <format>
+#include <string_view>
+#include <vector>
+
+namespace ks
+{
+
+/// An interned name. Symbols compare by id and index `SymbolMap`s directly, so name lookups during codegen neither
+/// hash nor allocate. The default symbol is the empty name.
+class Symbol
+{
+  public:
+    Symbol() = default;
+
+    static Symbol intern(std::string_view name);
+
+    std::string_view str() const;
+
+    std::uint32_t index() const
+    {
+        return this->id;
+    }
+
+    bool operator==(const Symbol&) const = default;
+    auto operator<=>(const Symbol&) const = default;
+
+  private:
+    explicit Symbol(std::uint32_t _id) : id(_id)
+    {
+    }
+
+    std::uint32_t id = 0u;
+};
+
+/// Flat table keyed by `Symbol`. `clear` only resets the slots that were set, so a map can be reused cheaply.
+template <typename T> class SymbolMap
+{
+  public:
+    bool contains(Symbol key) const
+    {
+        return key.index() < this->present.size() && this->present[key.index()];
+    }
+
+    T& operator[](Symbol key)
+    {
+        const auto idx = key.index();
+        if (idx >= this->values.size())
+        {
+            this->values.resize(idx + 1u);
+            this->present.resize(idx + 1u, false);
+        }
+        if (!this->present[idx])
+        {
+            this->present[idx] = true;
+            this->keys.push_back(key);
+        }
+        return this->values[idx];
+    }
+
+    T* find(Symbol key)
+    {
+        return this->contains(key) ? &this->values[key.index()] : nullptr;
+    }
+
+    const T* find(Symbol key) const
+    {
+        return this->contains(key) ? &this->values[key.index()] : nullptr;
+    }
+
+    void erase(Symbol key)
+    {
+        if (!this->contains(key))
+        {
+            return;
+        }
+        this->values[key.index()] = T();
+        this->present[key.index()] = false;
+        std::erase(this->keys, key);
+    }
+
+    void clear()
+    {
+        for (const auto key : this->keys)
+        {
+            this->values[key.index()] = T();
+            this->present[key.index()] = false;
+        }
+        this->keys.clear();
+    }
+
+    /// Keys in insertion order.
+    const std::vector<Symbol>& get_keys() const
+    {
+        return this->keys;
+    }
+
+  private:
+    std::vector<T> values{};
+    std::vector<bool> present{};
+    std::vector<Symbol> keys{};
+};
+
+} // namespace ks
+
+template <> struct std::formatter<ks::Symbol> : std::formatter<std::string_view>
+{
+    auto format(ks::Symbol s, format_context& ctx) const
+    {
+        return formatter<std::string_view>::format(s.str(), ctx);
+    }
+};
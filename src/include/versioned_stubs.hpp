@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/Support/Error.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "JITCompiler.hpp"
+#include "ast.hpp"
+#include "environment.hpp"
+#include "symbol.hpp"
+
+namespace ks
+{
+
+/// What the compilers that call each function `f` through an indirect stub to one of its versions `f.v<N>` share: the
+/// stubs, the prototypes new versions are generated against, and a background thread that compiles them one at a
+/// time, in the order they were posted.
+///
+/// Posted tasks usually refer to their owner, so the owner declares this member last: it is then destroyed first,
+/// and the thread is stopped before anything a task uses goes away. Tasks that have not started by then are dropped.
+class VersionedStubs
+{
+  public:
+    struct CompiledVersion
+    {
+        llvm::orc::ResourceTrackerSP resource_tracker = nullptr;
+        llvm::orc::ExecutorAddr address{};
+    };
+
+    VersionedStubs(JITCompiler& _jit_compiler, std::unique_ptr<llvm::orc::IndirectStubsManager> _stubs);
+    ~VersionedStubs();
+
+    VersionedStubs(const VersionedStubs&) = delete;
+    VersionedStubs& operator=(const VersionedStubs&) = delete;
+
+    static std::string version_name(Symbol name, unsigned version);
+
+    /// Makes `proto` callable from versions generated from now on, replacing an earlier prototype of its name.
+    void declare(const PrototypeAST& proto);
+
+    /// Undoes `declare`, for a definition that failed.
+    void forget(Symbol name);
+
+    std::optional<PrototypeAST> find(Symbol name) const;
+
+    /// Generates `ast` as `name.v<version>` into a fresh environment with every declared prototype. Recursive calls
+    /// stay within the version; every other caller goes through the stub.
+    std::optional<CodeGenEnvironment> generate(Symbol name, FunctionAST& ast, unsigned version) const;
+
+    /// Hands `env` to the JIT under a resource tracker of its own and looks `name.v<version>` up.
+    llvm::Expected<CompiledVersion> compile(CodeGenEnvironment& env, Symbol name, unsigned version);
+
+    /// Defines `name` as a stub to `version`. If that fails, the code of `version` is removed and the prototype of
+    /// `name` forgotten, so that nothing of the definition is left behind.
+    bool define_stub(Symbol name, const CompiledVersion& version);
+
+    /// Points the stub of `name` at `address` in one store; calls already past the stub are not affected.
+    llvm::Error update_stub(Symbol name, llvm::orc::ExecutorAddr address);
+
+    /// Runs `task` on the background thread after the tasks posted before it.
+    void post(llvm::unique_function<void()> task);
+
+    /// Blocks until every task posted so far has run.
+    void wait_until_idle();
+
+    static bool LogError(std::string_view str);
+
+  private:
+    JITCompiler& jit_compiler;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+    /// Guards everything below it; tasks are posted from any thread and the prototypes are read by the worker.
+    mutable std::mutex mutex{};
+    std::condition_variable wake{};
+    std::condition_variable idle{};
+    SymbolMap<std::unique_ptr<PrototypeAST>> prototypes{};
+    std::deque<llvm::unique_function<void()>> tasks{};
+    /// Tasks posted and not finished yet.
+    std::size_t pending = 0u;
+    bool stopping = false;
+    std::thread worker{};
+
+    void run_worker();
+};
+} // namespace ks
@@ -0,0 +1,204 @@
+#include "incremental.hpp"
+
+#include <format>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/Error.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+void DependencyGraph::set_callees(const Symbol caller, std::vector<Symbol> _callees)
+{
+    if (const auto previous = this->callees.find(caller))
+    {
+        for (const auto callee : *previous)
+        {
+            this->callers[callee].erase(caller);
+        }
+    }
+    for (const auto callee : _callees)
+    {
+        this->callers[callee].insert(caller);
+    }
+    this->callees[caller] = std::move(_callees);
+}
+
+std::vector<Symbol> DependencyGraph::collect_dependents(const Symbol name) const
+{
+    auto members = std::set<Symbol>{name};
+    auto pending = std::vector<Symbol>{name};
+    for (auto idx = std::size_t(0); idx < pending.size(); ++idx)
+    {
+        if (const auto found = this->callers.find(pending[idx]))
+        {
+            for (const auto caller : *found)
+            {
+                if (members.insert(caller).second)
+                {
+                    pending.push_back(caller);
+                }
+            }
+        }
+    }
+
+    auto ordered = std::vector<Symbol>();
+    ordered.reserve(pending.size());
+    auto visited = std::set<Symbol>();
+    for (const auto member : pending)
+    {
+        this->order_callees_first(member, members, visited, ordered);
+    }
+    return ordered;
+}
+
+void DependencyGraph::order_callees_first(const Symbol name, const std::set<Symbol>& members,
+                                          std::set<Symbol>& visited, std::vector<Symbol>& ordered) const
+{
+    if (!visited.insert(name).second)
+    {
+        return;
+    }
+    if (const auto found = this->callees.find(name))
+    {
+        for (const auto callee : *found)
+        {
+            if (members.contains(callee))
+            {
+                this->order_callees_first(callee, members, visited, ordered);
+            }
+        }
+    }
+    ordered.push_back(name);
+}
+
+bool IncrementalCompiler::LogError(const std::string_view str)
+{
+    std::cerr << str;
+    return false;
+}
+
+bool IncrementalCompiler::define(std::unique_ptr<FunctionAST> fun)
+{
+    const auto name = fun->get_prototype().get_name();
+    auto ast = std::shared_ptr<FunctionAST>(std::move(fun));
+    const auto previous = this->definitions.find(name);
+    if (previous != nullptr && !previous->ast->get_prototype().has_same_parameters(ast->get_prototype()))
+    {
+        return LogError(std::format("Function `{}` must keep its parameters when it is redefined.", name));
+    }
+    if (previous == nullptr)
+    {
+        if (ast->codegen(this->env) == nullptr)
+        {
+            return false;
+        }
+        this->definitions[name] = Definition{std::move(ast), nullptr};
+        if (!this->hand_off(name))
+        {
+            this->definitions.erase(name);
+            return false;
+        }
+        return true;
+    }
+
+    const auto dependents = this->graph.collect_dependents(name);
+    // Inlining the old body into a recompiled caller would bring the old behaviour back.
+    auto retained = SymbolMap<std::shared_ptr<FunctionAST>>();
+    for (const auto dependent : dependents)
+    {
+        if (const auto found = this->env.inlinable_functions.find(dependent))
+        {
+            retained[dependent] = std::move(*found);
+            this->env.inlinable_functions.erase(dependent);
+        }
+    }
+    // Every function is generated into a module of its own before any code is removed, so that if the definition or
+    // one of its callers does not compile, the old code keeps running. Callees come first, so each caller can inline
+    // the new bodies of those it calls.
+    auto modules = std::vector<llvm::orc::ThreadSafeModule>();
+    modules.reserve(dependents.size());
+    for (const auto dependent : dependents)
+    {
+        const auto& source = dependent == name ? ast : this->definitions.find(dependent)->ast;
+        if (source->codegen(this->env) == nullptr)
+        {
+            this->env.optimizer->reset();
+            this->env.initialize_module(this->jit_compiler.get_data_layout());
+            for (const auto generated : dependents)
+            {
+                this->env.inlinable_functions.erase(generated);
+            }
+            for (const auto key : retained.get_keys())
+            {
+                this->env.inlinable_functions[key] = std::move(*retained.find(key));
+            }
+            if (dependent != name)
+            {
+                LogError(std::format("Cannot recompile `{}`, which calls `{}`, so `{}` keeps its old definition.",
+                                     dependent, name, name));
+            }
+            return false;
+        }
+        this->env.retain_for_inlining(source);
+        modules.push_back(this->env.take_module(this->jit_compiler.get_data_layout()));
+    }
+
+    for (const auto dependent : dependents)
+    {
+        auto& definition = *this->definitions.find(dependent);
+        // A tracker is only missing if the JIT rejected the function's module during an earlier redefinition.
+        if (definition.resource_tracker == nullptr)
+        {
+            continue;
+        }
+        if (auto err = definition.resource_tracker->remove())
+        {
+            return LogError(std::format("Cannot remove the code of `{}`: {}", dependent,
+                                        llvm::toString(std::move(err))));
+        }
+        definition.resource_tracker = nullptr;
+    }
+
+    previous->ast = std::move(ast);
+    for (auto idx = std::size_t(0); idx < dependents.size(); ++idx)
+    {
+        const auto dependent = dependents[idx];
+        auto& definition = *this->definitions.find(dependent);
+        auto resource_tracker = this->jit_compiler.get_main_jit_dylib().createResourceTracker();
+        if (auto err = this->jit_compiler.add_module(std::move(modules[idx]), resource_tracker))
+        {
+            return LogError(std::format("Cannot compile `{}`: {}", dependent, llvm::toString(std::move(err))));
+        }
+        definition.resource_tracker = std::move(resource_tracker);
+        this->graph.set_callees(dependent, definition.ast->collect_callees());
+        this->recompiled += dependent == name ? 0u : 1u;
+    }
+    return true;
+}
+
+bool IncrementalCompiler::hand_off(const Symbol name)
+{
+    auto& definition = *this->definitions.find(name);
+    this->env.retain_for_inlining(definition.ast);
+    auto resource_tracker = this->env.add_to_jit_compiler(this->jit_compiler, true);
+    if (!resource_tracker)
+    {
+        this->env.inlinable_functions.erase(name);
+        return LogError(std::format("Cannot compile `{}`: {}", name, llvm::toString(resource_tracker.takeError())));
+    }
+    definition.resource_tracker = std::move(*resource_tracker);
+    this->graph.set_callees(name, definition.ast->collect_callees());
+    return true;
+}
+} // namespace ks
@@ -0,0 +1,288 @@
+#include "interpreter.hpp"
+
+#include <algorithm>
+#include <array>
+#include <format>
+#include <iostream>
+#include <string>
+#include <utility>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorHandling.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+namespace
+{
+using Operator = double (*)(double, double);
+
+/// The predefined operators, evaluated directly instead of through their JIT-compiled definitions.
+Operator find_operator(const Symbol name)
+{
+    static const auto operators = std::array<std::pair<Symbol, Operator>, 5>{{
+        {Symbol::intern("+"), [](double lhs, double rhs) { return lhs + rhs; }},
+        {Symbol::intern("-"), [](double lhs, double rhs) { return lhs - rhs; }},
+        {Symbol::intern("*"), [](double lhs, double rhs) { return lhs * rhs; }},
+        {Symbol::intern("/"), [](double lhs, double rhs) { return lhs / rhs; }},
+        // `fcmp ult`: true when either side is NaN, like the compiled operator.
+        {Symbol::intern("<"), [](double lhs, double rhs) { return !(lhs >= rhs) ? 1.0 : 0.0; }},
+    }};
+    const auto it = std::ranges::find(operators, name, &std::pair<Symbol, Operator>::first);
+    return it == operators.end() ? nullptr : it->second;
+}
+
+template <std::size_t... I>
+double call_with(const llvm::orc::ExecutorAddr address, std::span<const double> args, std::index_sequence<I...>)
+{
+    using FunctionPointer = double (*)(decltype(static_cast<void>(I), 0.0)...);
+    return address.toPtr<FunctionPointer>()(args[I]...);
+}
+
+double call_native(const llvm::orc::ExecutorAddr address, std::span<const double> args)
+{
+    switch (args.size())
+    {
+    case 0u:
+        return call_with(address, args, std::make_index_sequence<0u>());
+    case 1u:
+        return call_with(address, args, std::make_index_sequence<1u>());
+    case 2u:
+        return call_with(address, args, std::make_index_sequence<2u>());
+    case 3u:
+        return call_with(address, args, std::make_index_sequence<3u>());
+    case 4u:
+        return call_with(address, args, std::make_index_sequence<4u>());
+    case 5u:
+        return call_with(address, args, std::make_index_sequence<5u>());
+    case 6u:
+        return call_with(address, args, std::make_index_sequence<6u>());
+    default:
+        llvm_unreachable("arity is checked against max_native_arity by the caller");
+    }
+}
+} // namespace
+
+std::optional<double> Interpreter::LogError(const std::string_view str)
+{
+    std::cerr << str;
+    return std::nullopt;
+}
+
+bool Interpreter::define(std::unique_ptr<FunctionAST> fun)
+{
+    const auto& proto = fun->get_prototype();
+    const auto name = proto.get_name();
+    if (this->functions.contains(name) || this->env.function_prototypes.contains(name))
+    {
+        LogError(std::format("Function `{}` cannot be redefined.", name));
+        return false;
+    }
+
+    // Generating a hot function declares its callees from these prototypes.
+    this->env.function_prototypes[name] = std::make_unique<PrototypeAST>(proto);
+    auto& entry = this->functions[name];
+    entry.arity = proto.get_args().size();
+    entry.takes_arrays = proto.takes_arrays();
+    entry.native = std::make_shared<std::atomic<std::uint64_t>>(0u);
+    entry.ast = std::move(fun);
+    return true;
+}
+
+bool Interpreter::declare(const PrototypeAST& proto)
+{
+    const auto name = proto.get_name();
+    if (const auto existing = this->functions.find(name); existing != nullptr && existing->ast != nullptr)
+    {
+        LogError(std::format("Function `{}` is already defined.", name));
+        return false;
+    }
+
+    this->env.function_prototypes[name] = std::make_unique<PrototypeAST>(proto);
+    auto& entry = this->functions[name];
+    entry.arity = proto.get_args().size();
+    entry.takes_arrays = proto.takes_arrays();
+    entry.native = std::make_shared<std::atomic<std::uint64_t>>(0u);
+    return true;
+}
+
+std::optional<double> Interpreter::run(const FunctionAST& fun)
+{
+    this->frames.push_back(Frame{});
+    const auto result = fun.evaluate(*this);
+    this->frames.pop_back();
+    return result;
+}
+
+std::optional<double> Interpreter::lookup_variable(const Symbol name) const
+{
+    if (!this->frames.empty())
+    {
+        // Searched backwards, so a repeated parameter name binds the last argument, as in compiled code.
+        const auto& frame = this->frames.back();
+        for (auto idx = frame.params.size(); idx-- > 0u;)
+        {
+            if (frame.params[idx] == name)
+            {
+                return frame.args[idx];
+            }
+        }
+    }
+    return LogError(std::format("Unknown variable `{}`", name));
+}
+
+std::optional<double> Interpreter::call(Symbol callee, std::span<const double> args)
+{
+    auto current_args = llvm::SmallVector<double, 8>(args.begin(), args.end());
+    while (true)
+    {
+        const auto result = this->call_once(callee, current_args);
+        if (!result || !this->pending_tail_call)
+        {
+            this->pending_tail_call.reset();
+            return result;
+        }
+        callee = this->pending_tail_call->callee;
+        current_args = std::move(this->pending_tail_call->args);
+        this->pending_tail_call.reset();
+    }
+}
+
+std::optional<double> Interpreter::request_tail_call(const Symbol callee, std::span<const double> args)
+{
+    this->pending_tail_call = TailCall{callee, llvm::SmallVector<double, 8>(args.begin(), args.end())};
+    return 0.0;
+}
+
+std::optional<double> Interpreter::call_once(const Symbol callee, std::span<const double> args)
+{
+    const auto fun = this->functions.find(callee);
+    if (fun == nullptr)
+    {
+        const auto op = find_operator(callee);
+        if (op == nullptr)
+        {
+            return LogError(std::format("Unknown function `{}`", callee));
+        }
+        if (args.size() != 2u)
+        {
+            return LogError(std::format("function `{}` expects 2 arguments, passed {} arguments", callee, args.size()));
+        }
+        return op(args[0], args[1]);
+    }
+
+    if (fun->arity != args.size())
+    {
+        return LogError(std::format("function `{}` expects {} arguments, passed {} arguments", callee, fun->arity,
+                                    args.size()));
+    }
+
+    if (fun->takes_arrays)
+    {
+        return LogError(std::format("`{}` takes arrays and can only be called from compiled code", callee));
+    }
+
+    auto address = fun->native->load(std::memory_order_acquire);
+    if (address == 0u && fun->ast == nullptr)
+    {
+        if (args.size() > max_native_arity)
+        {
+            return LogError(std::format("Cannot call `{}` with more than {} arguments", callee, max_native_arity));
+        }
+        auto symbol = this->jit_compiler.lookup(callee.str());
+        if (!symbol)
+        {
+            return LogError(llvm::toString(symbol.takeError()));
+        }
+        address = symbol->getAddress().getValue();
+        fun->native->store(address, std::memory_order_release);
+    }
+    if (address != 0u && args.size() <= max_native_arity)
+    {
+        return call_native(llvm::orc::ExecutorAddr(address), args);
+    }
+
+    if (++fun->calls == this->hot_threshold && !fun->handed_to_jit)
+    {
+        this->compile(callee);
+    }
+
+    this->frames.push_back(Frame{fun->ast->get_prototype().get_args(), args});
+    const auto result = fun->ast->evaluate_tail(*this);
+    this->frames.pop_back();
+    return result;
+}
+
+void Interpreter::compile(const Symbol name)
+{
+    // Native code can only call what the JIT can resolve, so every interpreted function reachable from `name` goes
+    // into the same module. Callees show up as declarations once their caller is generated.
+    auto batch = std::vector<Symbol>();
+    auto pending = std::vector<Symbol>{name};
+    while (!pending.empty())
+    {
+        const auto next = pending.back();
+        pending.pop_back();
+        const auto fun = this->functions.find(next);
+        if (fun == nullptr || fun->ast == nullptr || fun->handed_to_jit ||
+            std::ranges::find(batch, next) != batch.end())
+        {
+            continue;
+        }
+        if (fun->ast->codegen(this->env) == nullptr)
+        {
+            // The function keeps being interpreted; nothing of this batch is handed over.
+            this->env.optimizer->reset();
+            this->env.initialize_module(this->jit_compiler.get_data_layout());
+            return;
+        }
+        batch.push_back(next);
+        for (const auto& declaration : *this->env.module)
+        {
+            if (declaration.isDeclaration())
+            {
+                pending.push_back(Symbol::intern(std::string_view(declaration.getName())));
+            }
+        }
+    }
+
+    if (auto added = this->env.add_to_jit_compiler(this->jit_compiler); !added)
+    {
+        // The functions keep being interpreted.
+        std::cerr << std::format("Background compilation failed: {}\n", llvm::toString(added.takeError()));
+        return;
+    }
+    auto names = std::vector<std::string>();
+    auto addresses = std::vector<NativeAddress>();
+    for (const auto symbol : batch)
+    {
+        auto& fun = this->functions[symbol];
+        fun.handed_to_jit = true;
+        names.emplace_back(symbol.str());
+        addresses.push_back(fun.native);
+    }
+    this->jit_compiler.lookup_all_async(
+        names, [addresses = std::move(addresses), compiled = this->compiled_functions](
+                   llvm::Expected<std::vector<llvm::orc::ExecutorSymbolDef>> definitions) {
+            if (!definitions)
+            {
+                std::cerr << std::format("Background compilation failed: {}\n",
+                                         llvm::toString(definitions.takeError()));
+                return;
+            }
+            for (auto idx = std::size_t(0); idx < addresses.size(); ++idx)
+            {
+                addresses[idx]->store((*definitions)[idx].getAddress().getValue(), std::memory_order_release);
+            }
+            *compiled += addresses.size();
+        });
+}
+} // namespace ks
@@ -1,77 +1,177 @@
 #include "lexer.hpp"
 
+#include <array>
 #include <cassert>
-#include <cctype>
+#include <charconv>
+#include <cstdint>
 #include <cstdio>
-#include <sstream>
+#include <optional>
+#include <system_error>
 
 namespace ks
 {
 
-Token Lexer::get_token()
+namespace
+{
+enum class CharClass : std::uint8_t
 {
-    while ((std::isspace(this->last_char) || this->last_char == 0) && this->last_char != EOF)
+    IDENTIFIER,
+    SPACE,
+    LEFT_PAREN,
+    RIGHT_PAREN,
+    COMMENT,
+};
+
+constexpr auto char_classes = []() {
+    auto table = std::array<CharClass, 256>();
+    table.fill(CharClass::IDENTIFIER);
+    for (const auto c : {' ', '\t', '\n', '\v', '\f', '\r', '\0'})
     {
-        this->last_char = this->getchar();
+        table[static_cast<unsigned char>(c)] = CharClass::SPACE;
     }
-    if (this->last_char == EOF)
+    table[static_cast<unsigned char>('(')] = CharClass::LEFT_PAREN;
+    table[static_cast<unsigned char>(')')] = CharClass::RIGHT_PAREN;
+    table[static_cast<unsigned char>(';')] = CharClass::COMMENT;
+    return table;
+}();
+
+CharClass classify(const char c)
+{
+    return char_classes[static_cast<unsigned char>(c)];
+}
+
+bool ends_identifier(const char c)
+{
+    const auto cls = classify(c);
+    return cls == CharClass::SPACE || cls == CharClass::LEFT_PAREN || cls == CharClass::RIGHT_PAREN;
+}
+
+bool is_digit_or_dot(const char c)
+{
+    return ('0' <= c && c <= '9') || c == '.';
+}
+
+/// Numbers start with a digit or a dot, optionally signed. Anything else, including `inf` and `nan`, stays an
+/// identifier.
+std::optional<double> parse_number(std::string_view text)
+{
+    if (text.size() > 1u && text[0] == '+' && is_digit_or_dot(text[1]))
     {
-        return Token(TokenType::END_OF_FILE);
+        text.remove_prefix(1u);
     }
-    else if (this->last_char == ';')
+    else if (!(is_digit_or_dot(text[0]) || (text.size() > 1u && text[0] == '-' && is_digit_or_dot(text[1]))))
     {
-        do
-        {
-            this->last_char = this->getchar();
-        } while (this->last_char != EOF && this->last_char != '\n' && this->last_char != '\r');
+        return std::nullopt;
+    }
 
-        return get_token();
+    auto value = 0.0;
+    const auto last = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data(), last, value);
+    if (ec != std::errc() || ptr != last)
+    {
+        return std::nullopt;
     }
-    else if (this->last_char == '(')
+    return value;
+}
+} // namespace
+
+llvm::Expected<Lexer> Lexer::from_file(llvm::StringRef path)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer)
     {
-        this->last_char = this->getchar();
-        return Token(TokenType::LEFT_PAREN);
+        return llvm::createFileError(path, buffer.getError());
     }
-    else if (this->last_char == ')')
+    return Lexer(std::move(*buffer));
+}
+
+bool Lexer::refill()
+{
+    if (this->is == nullptr || !*this->is)
     {
-        this->last_char = this->getchar();
-        return Token(TokenType::RIGHT_PAREN);
+        return false;
     }
-    else
-    { // Identifiers
-        auto identifier_ss = std::stringstream();
-        identifier_ss << this->last_char;
-        while (true)
+
+    // Tokens never span lines, so the previous chunk can be dropped as a whole. Besides the line we have to wait
+    // for, take whatever the stream has already buffered.
+    this->chunk.clear();
+    this->pos = 0u;
+    while (this->chunk.size() < chunk_size && std::getline(*this->is, this->line))
+    {
+        this->chunk.append(this->line);
+        this->chunk.push_back('\n');
+        if (this->is->rdbuf()->in_avail() <= 0)
         {
-            this->last_char = this->getchar();
-            if (std::isspace(this->last_char) || this->last_char == EOF)
-            {
-                break;
-            }
-            else if (this->last_char == '(' || this->last_char == ')')
-            {
-                break;
-            }
-            else
+            break;
+        }
+    }
+    return !this->chunk.empty();
+}
+
+Token Lexer::get_token()
+{
+    while (true)
+    {
+        auto buf = this->buffer();
+        while (this->pos < buf.size() && classify(buf[this->pos]) == CharClass::SPACE)
+        {
+            ++this->pos;
+        }
+        if (this->pos == buf.size())
+        {
+            if (!this->refill())
             {
-                identifier_ss << this->last_char;
+                return Token(TokenType::END_OF_FILE);
             }
+            continue;
         }
 
-        if (identifier_ss.str() == "define")
+        switch (classify(buf[this->pos]))
+        {
+        case CharClass::COMMENT: {
+            const auto eol = buf.find_first_of("\r\n", this->pos);
+            this->pos = eol == std::string_view::npos ? buf.size() : eol;
+            continue;
+        }
+        case CharClass::LEFT_PAREN:
+            ++this->pos;
+            return Token(TokenType::LEFT_PAREN);
+        case CharClass::RIGHT_PAREN:
+            ++this->pos;
+            return Token(TokenType::RIGHT_PAREN);
+        case CharClass::SPACE:
+        case CharClass::IDENTIFIER:
+            break;
+        }
+
+        // Identifiers
+        const auto start = this->pos;
+        while (this->pos < buf.size() && !ends_identifier(buf[this->pos]))
+        {
+            ++this->pos;
+        }
+        const auto identifier = buf.substr(start, this->pos - start);
+
+        if (identifier == "define")
         {
             return Token(TokenType::DEF);
         }
-        else if (identifier_ss.str() == "extern")
+        else if (identifier == "extern")
         {
             return Token(TokenType::EXTERN);
         }
+        else if (identifier == "if")
+        {
+            return Token(TokenType::IF);
+        }
+        else if (const auto number = parse_number(identifier))
+        {
+            return Token(TokenType::NUMBER, identifier, Symbol(), *number);
+        }
         else
         {
-            return Token(TokenType::IDENTIFIER, identifier_ss.str());
+            return Token(TokenType::IDENTIFIER, identifier, Symbol::intern(identifier));
         }
-    } // end identifiers
-    assert(false); // unreachable
-    std::exit(-1);
+    }
 }
 } // namespace ks
@@ -1,40 +1,100 @@
+#include <cstdint>
 #include <format>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <llvm/Support/raw_ostream.h>
+#include <string>
 #include <variant>
+#include <vector>
 
 #include "JITCompiler.hpp"
 #include "ast.hpp"
+#include "emitter.hpp"
+#include "engine.hpp"
 #include "environment.hpp"
+#include "hot_swap.hpp"
+#include "incremental.hpp"
+#include "interpreter.hpp"
 #include "lexer.hpp"
+#include "optimizer.hpp"
 #include "parser.hpp"
+#include "prelude.hpp"
+#include "reoptimizer.hpp"
+#include "statistics.hpp"
 
-int main()
+/// Maps the argument of `-O` to LLVM's pipeline and codegen levels.
+static std::optional<ks::OptLevel> parse_opt_level(const char level)
 {
-    static llvm::ExitOnError exit_on_error;
-    auto lexer = ks::Lexer(std::cin);
-    auto parser = ks::Parser(std::move(lexer));
-    auto jit_compiler = ks::JITCompiler::create();
-    auto p_jit_compiler = jit_compiler ? std::move(jit_compiler.get()) : nullptr;
-    if (!p_jit_compiler)
+    switch (level)
     {
-        std::cout << llvm::toString(jit_compiler.takeError());
-        return 0;
+    case '0':
+        return ks::OptLevel{llvm::OptimizationLevel::O0, llvm::CodeGenOptLevel::None};
+    case '1':
+        return ks::OptLevel{llvm::OptimizationLevel::O1, llvm::CodeGenOptLevel::Less};
+    case '2':
+        return ks::OptLevel{llvm::OptimizationLevel::O2, llvm::CodeGenOptLevel::Default};
+    case '3':
+        return ks::OptLevel{llvm::OptimizationLevel::O3, llvm::CodeGenOptLevel::Aggressive};
+    case 's':
+        return ks::OptLevel{llvm::OptimizationLevel::Os, llvm::CodeGenOptLevel::Default};
+    case 'z':
+        return ks::OptLevel{llvm::OptimizationLevel::Oz, llvm::CodeGenOptLevel::Default};
+    default:
+        return std::nullopt;
+    }
+}
+
+static llvm::Expected<ks::Lexer> open_input(const std::string& filename)
+{
+    if (filename == "-")
+    {
+        return ks::Lexer(std::cin);
     }
-    auto env = ks::CodeGenEnvironment::predefined_operators(p_jit_compiler->get_data_layout());
-    env.add_to_jit_compiler(*p_jit_compiler);
+    return ks::Lexer::from_file(filename);
+}
+
+static std::optional<ks::Parser::ParseResult> parse(ks::Parser& parser, ks::Statistics* statistics)
+{
+    const auto scope = ks::Statistics::Scope(statistics, ks::Phase::PARSE);
+    return parser.parse_top_level();
+}
+
+static bool generate(ks::Parser::ParseResult& form, ks::CodeGenEnvironment& env, ks::Statistics* statistics)
+{
+    const auto scope = ks::Statistics::Scope(statistics, ks::Phase::IR_GENERATION);
+    return std::visit([&env](auto& x) { return x->codegen(env) != nullptr; }, form);
+}
+
+/// Evaluates every form as soon as it is parsed. Functions may be redefined; see `ks::IncrementalCompiler`.
+static void run_interactive(ks::Parser& parser, ks::JITCompiler& jit_compiler, ks::CodeGenEnvironment& env,
+                            ks::Statistics* statistics)
+{
+    static llvm::ExitOnError exit_on_error;
+    auto incremental = ks::IncrementalCompiler(jit_compiler, env);
     while (true)
     {
         std::cout << "> ";
-        auto result = parser.parse_top_level();
+        auto result = parse(parser, statistics);
         if (!result.has_value())
         {
             break;
         }
         auto p = std::move(result.value());
-        auto fn_ir = std::visit([&env](auto& x) { return x->codegen(env); }, p);
-
-        if (!fn_ir)
+        if (const auto fun_ast = std::get_if<std::unique_ptr<ks::FunctionAST>>(&p);
+            fun_ast != nullptr && !(*fun_ast)->is_top_level_expression())
+        {
+            const auto scope = ks::Statistics::Scope(statistics, ks::Phase::IR_GENERATION);
+            if (!incremental.define(std::move(*fun_ast)))
+            {
+                break;
+            }
+            continue;
+        }
+        if (!generate(p, env, statistics))
         {
             break;
         }
@@ -42,21 +102,445 @@ int main()
         if (std::holds_alternative<std::unique_ptr<ks::FunctionAST>>(p))
         {
             auto& fun_ast = std::get<std::unique_ptr<ks::FunctionAST>>(p);
-            const auto is_top_expr = fun_ast->is_top_level_expression();
-            auto resource_tracker = env.add_to_jit_compiler(*p_jit_compiler, is_top_expr);
-            if (is_top_expr)
+            auto resource_tracker = exit_on_error(env.add_to_jit_compiler(jit_compiler, true));
+            auto ExprSymbol = exit_on_error(jit_compiler.lookup(fun_ast->get_name()));
+
+            // Get the symbol's address and cast it to the right type (takes no
+            // arguments, returns a double) so we can call it as a native function.
+            auto FP = ExprSymbol.getAddress().toPtr<double (*)()>();
+            std::cout << std::format("Evaluated to {}\n", FP());
+            exit_on_error(resource_tracker->remove());
+        }
+    }
+    if (incremental.count_recompiled_functions() > 0u)
+    {
+        std::cerr << std::format("{} callers were recompiled after redefinitions\n",
+                                 incremental.count_recompiled_functions());
+    }
+
+    env.module->print(llvm::errs(), nullptr);
+}
+
+/// Generates every form into the environment's module, hands the code to the JIT, and only then runs the top-level
+/// expressions in source order. Nothing runs unless the whole input parses and compiles. A non-zero `chunk_size`
+/// starts a new module after that many definitions, so that the modules can be compiled in parallel.
+static bool run_batch(ks::Parser& parser, ks::JITCompiler& jit_compiler, ks::CodeGenEnvironment& env,
+                      const unsigned chunk_size, ks::Statistics* statistics)
+{
+    static llvm::ExitOnError exit_on_error;
+    auto top_level_names = std::vector<std::string>();
+    auto definitions_in_module = 0u;
+    while (auto result = parse(parser, statistics))
+    {
+        auto p = std::move(result.value());
+        if (!generate(p, env, statistics))
+        {
+            return false;
+        }
+
+        if (std::holds_alternative<std::unique_ptr<ks::FunctionAST>>(p))
+        {
+            auto& fun_ast = std::get<std::unique_ptr<ks::FunctionAST>>(p);
+            if (fun_ast->is_top_level_expression())
             {
-                auto ExprSymbol = exit_on_error(p_jit_compiler->lookup(fun_ast->get_name()));
+                top_level_names.emplace_back(fun_ast->get_name());
+                continue;
+            }
+            env.retain_for_inlining(std::move(fun_ast));
+            if (chunk_size > 0u && ++definitions_in_module == chunk_size)
+            {
+                exit_on_error(env.add_to_jit_compiler(jit_compiler));
+                definitions_in_module = 0u;
+            }
+        }
+    }
+    if (!parser.reached_end_of_input())
+    {
+        std::cerr << "Failed to parse the input; nothing was run\n";
+        return false;
+    }
 
-                // Get the symbol's address and cast it to the right type (takes no
-                // arguments, returns a double) so we can call it as a native function.
-                auto FP = ExprSymbol.getAddress().toPtr<double (*)()>();
-                std::cout << std::format("Evaluated to {}\n", FP());
-                exit_on_error(resource_tracker->remove());
+    exit_on_error(env.add_to_jit_compiler(jit_compiler));
+    const auto symbols = exit_on_error(jit_compiler.lookup_all(top_level_names));
+    for (const auto& symbol : symbols)
+    {
+        auto fp = symbol.getAddress().toPtr<double (*)()>();
+        std::cout << std::format("Evaluated to {}\n", fp());
+    }
+    return true;
+}
+
+/// Evaluates every form as soon as it is parsed with the interpreter, which compiles hot functions in the background.
+static bool run_tiered(ks::Parser& parser, ks::JITCompiler& jit_compiler, ks::CodeGenEnvironment& env,
+                       const std::uint64_t hot_threshold, ks::Statistics* statistics)
+{
+    auto interpreter = ks::Interpreter(jit_compiler, env, hot_threshold);
+    auto ok = true;
+    while (true)
+    {
+        std::cout << "> ";
+        auto result = parse(parser, statistics);
+        if (!result.has_value())
+        {
+            break;
+        }
+        auto p = std::move(result.value());
+        if (std::holds_alternative<std::unique_ptr<ks::PrototypeAST>>(p))
+        {
+            ok = interpreter.declare(*std::get<std::unique_ptr<ks::PrototypeAST>>(p)) && ok;
+            continue;
+        }
+
+        auto& fun_ast = std::get<std::unique_ptr<ks::FunctionAST>>(p);
+        if (!fun_ast->is_top_level_expression())
+        {
+            ok = interpreter.define(std::move(fun_ast)) && ok;
+            continue;
+        }
+        if (const auto value = interpreter.run(*fun_ast))
+        {
+            std::cout << std::format("Evaluated to {}\n", *value);
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+
+    std::cerr << std::format("{} hot functions were compiled\n", interpreter.count_compiled_functions());
+    return ok;
+}
+
+/// Compiles every definition instrumented, behind a stub that is redirected once the function has been reoptimized
+/// with its profile. Top-level expressions are compiled as usual and call the stubs.
+static bool run_reoptimizing(ks::Parser& parser, ks::JITCompiler& jit_compiler, ks::CodeGenEnvironment& env,
+                             const std::uint64_t hot_threshold, ks::Statistics* statistics)
+{
+    static llvm::ExitOnError exit_on_error;
+    auto reoptimizer = exit_on_error(ks::Reoptimizer::create(jit_compiler, hot_threshold));
+    auto ok = true;
+    while (true)
+    {
+        std::cout << "> ";
+        auto result = parse(parser, statistics);
+        if (!result.has_value())
+        {
+            break;
+        }
+        auto p = std::move(result.value());
+        if (std::holds_alternative<std::unique_ptr<ks::PrototypeAST>>(p))
+        {
+            const auto& proto = *std::get<std::unique_ptr<ks::PrototypeAST>>(p);
+            env.function_prototypes[proto.get_name()] = std::make_unique<ks::PrototypeAST>(proto);
+            reoptimizer->declare(proto);
+            continue;
+        }
+
+        auto& fun_ast = std::get<std::unique_ptr<ks::FunctionAST>>(p);
+        if (!fun_ast->is_top_level_expression())
+        {
+            const auto name = fun_ast->get_prototype().get_name();
+            env.function_prototypes[name] = std::make_unique<ks::PrototypeAST>(fun_ast->get_prototype());
+            if (!reoptimizer->define(std::move(fun_ast)))
+            {
+                env.function_prototypes.erase(name);
+                ok = false;
             }
+            continue;
+        }
+        if (!generate(p, env, statistics))
+        {
+            ok = false;
+            continue;
         }
+        auto resource_tracker = exit_on_error(env.add_to_jit_compiler(jit_compiler, true));
+        auto symbol = exit_on_error(jit_compiler.lookup(fun_ast->get_name()));
+        std::cout << std::format("Evaluated to {}\n", symbol.getAddress().toPtr<double (*)()>()());
+        exit_on_error(resource_tracker->remove());
     }
 
-    env.module->print(llvm::errs(), nullptr);
-    return 0;
+    std::cerr << std::format("{} hot functions were reoptimized\n", reoptimizer->count_reoptimized_functions());
+    return ok;
+}
+
+/// Calls every defined function through a stub, so that a redefinition is compiled in the background and swapped in
+/// while the old version may still run. Top-level expressions wait for the swaps before them, so that they see the
+/// latest definitions.
+static bool run_hot_swapping(ks::Parser& parser, ks::JITCompiler& jit_compiler, ks::CodeGenEnvironment& env,
+                             ks::Statistics* statistics)
+{
+    static llvm::ExitOnError exit_on_error;
+    auto swapper = exit_on_error(ks::HotSwapper::create(jit_compiler));
+    auto ok = true;
+    while (true)
+    {
+        std::cout << "> ";
+        auto result = parse(parser, statistics);
+        if (!result.has_value())
+        {
+            break;
+        }
+        auto p = std::move(result.value());
+        if (std::holds_alternative<std::unique_ptr<ks::PrototypeAST>>(p))
+        {
+            const auto& proto = *std::get<std::unique_ptr<ks::PrototypeAST>>(p);
+            env.function_prototypes[proto.get_name()] = std::make_unique<ks::PrototypeAST>(proto);
+            swapper->declare(proto);
+            continue;
+        }
+
+        auto& fun_ast = std::get<std::unique_ptr<ks::FunctionAST>>(p);
+        if (!fun_ast->is_top_level_expression())
+        {
+            auto proto = std::make_unique<ks::PrototypeAST>(fun_ast->get_prototype());
+            if (swapper->define(std::move(fun_ast)))
+            {
+                env.function_prototypes[proto->get_name()] = std::move(proto);
+            }
+            else
+            {
+                ok = false;
+            }
+            continue;
+        }
+        if (!generate(p, env, statistics))
+        {
+            ok = false;
+            continue;
+        }
+        if (!swapper->wait_until_swapped())
+        {
+            ok = false;
+        }
+        // No JIT'd code runs between two lines of input, so the replaced versions can go.
+        swapper->collect();
+        auto resource_tracker = exit_on_error(env.add_to_jit_compiler(jit_compiler, true));
+        auto symbol = exit_on_error(jit_compiler.lookup(fun_ast->get_name()));
+        std::cout << std::format("Evaluated to {}\n", symbol.getAddress().toPtr<double (*)()>()());
+        exit_on_error(resource_tracker->remove());
+    }
+
+    if (!swapper->wait_until_swapped())
+    {
+        ok = false;
+    }
+    swapper->collect();
+    std::cerr << std::format("{} functions were swapped, freeing {} old versions\n", swapper->count_swapped_functions(),
+                             swapper->count_freed_versions());
+    return ok;
+}
+
+struct AOTOutputs
+{
+    std::string object_path;
+    std::string library_path;
+    std::string header_path;
+
+    bool any() const
+    {
+        return !this->object_path.empty() || !this->library_path.empty() || !this->header_path.empty();
+    }
+};
+
+/// Compiles the definitions of the input ahead of time, without creating a JIT. Nothing would run top-level
+/// expressions, so they are skipped.
+static bool run_aot(ks::Parser& parser, const AOTOutputs& outputs, const std::optional<ks::OptLevel>& opt_level)
+{
+    const auto report = [](llvm::Error err) {
+        if (err)
+        {
+            std::cerr << llvm::toString(std::move(err)) << '\n';
+            return false;
+        }
+        return true;
+    };
+
+    auto emitter = ks::ObjectEmitter::create(opt_level ? opt_level->codegen : llvm::CodeGenOptLevel::Default);
+    if (!emitter)
+    {
+        return report(emitter.takeError());
+    }
+    auto optimizer = std::unique_ptr<ks::OptimizationPipeline>();
+    if (opt_level)
+    {
+        auto target_machine = emitter->create_target_machine();
+        if (!target_machine)
+        {
+            return report(target_machine.takeError());
+        }
+        optimizer = std::make_unique<ks::OptimizationPipeline>(opt_level->ir, std::move(*target_machine));
+    }
+    auto env = ks::CodeGenEnvironment::predefined_operators(emitter->get_data_layout(), std::move(optimizer));
+    while (auto result = parser.parse_top_level())
+    {
+        auto p = std::move(result.value());
+        if (std::holds_alternative<std::unique_ptr<ks::FunctionAST>>(p))
+        {
+            const auto& fun_ast = std::get<std::unique_ptr<ks::FunctionAST>>(p);
+            if (fun_ast->is_top_level_expression())
+            {
+                std::cerr << std::format("Skipping top-level expression `{}`\n", fun_ast->get_name());
+                continue;
+            }
+        }
+        if (!std::visit([&env](auto& x) { return x->codegen(env); }, p))
+        {
+            return false;
+        }
+    }
+
+    env.finalize_module();
+    if (!outputs.header_path.empty() &&
+        !report(ks::ObjectEmitter::write_c_header(*env.module, env.function_prototypes, outputs.header_path)))
+    {
+        return false;
+    }
+    if (outputs.object_path.empty() && outputs.library_path.empty())
+    {
+        return true;
+    }
+
+    auto object = emitter->emit_object(*env.module);
+    if (!object)
+    {
+        return report(object.takeError());
+    }
+    if (!outputs.object_path.empty() && !report(ks::ObjectEmitter::write_object(*object, outputs.object_path)))
+    {
+        return false;
+    }
+    return outputs.library_path.empty() || report(emitter->write_static_library(*object, outputs.library_path));
+}
+
+int main(int argc, char** argv)
+{
+    auto input_filename =
+        llvm::cl::opt<std::string>(llvm::cl::Positional, llvm::cl::desc("<input file>"), llvm::cl::init("-"));
+    auto batch = llvm::cl::opt<bool>(
+        "batch", llvm::cl::desc("Compile the whole input into one module before running its top-level expressions"));
+    auto lazy = llvm::cl::opt<bool>("lazy", llvm::cl::desc("Compile each function on its first call"));
+    auto threads = llvm::cl::opt<unsigned>("threads", llvm::cl::desc("Number of JIT compile threads (0: none)"),
+                                           llvm::cl::init(0u));
+    auto batch_chunk = llvm::cl::opt<unsigned>(
+        "batch-chunk", llvm::cl::desc("Definitions per module in --batch mode when compiling on threads"),
+        llvm::cl::init(64u));
+    auto tiered = llvm::cl::opt<bool>(
+        "tiered", llvm::cl::desc("Interpret code first and compile functions once they are called often"));
+    auto reoptimize = llvm::cl::opt<bool>(
+        "reoptimize", llvm::cl::desc("Profile compiled functions and recompile hot ones with their profile at -O3"));
+    auto hot_swap = llvm::cl::opt<bool>(
+        "hot-swap", llvm::cl::desc("Call functions through stubs and swap redefinitions in from a background thread"));
+    auto hot_threshold = llvm::cl::opt<std::uint64_t>(
+        "hot-threshold",
+        llvm::cl::desc("Calls before --tiered compiles or --reoptimize recompiles a function (0: never)"),
+        llvm::cl::init(100u));
+    auto opt_level_flag = llvm::cl::opt<char>(
+        "O", llvm::cl::desc("Optimization level: -O0, -O1, -O2, -O3, -Os or -Oz (default: a few passes per function)"),
+        llvm::cl::Prefix);
+    auto cache_dir =
+        llvm::cl::opt<std::string>("cache-dir", llvm::cl::desc("Cache compiled objects in this directory"));
+    auto emit_obj =
+        llvm::cl::opt<std::string>("emit-obj", llvm::cl::desc("Compile ahead of time into this object file"));
+    auto emit_lib =
+        llvm::cl::opt<std::string>("emit-lib", llvm::cl::desc("Compile ahead of time into this static library"));
+    auto emit_header = llvm::cl::opt<std::string>(
+        "emit-header", llvm::cl::desc("Write a C header declaring the compiled functions to this file"));
+    auto stats = llvm::cl::opt<bool>(
+        "stats", llvm::cl::desc("Print time per phase, module and instruction counts and code sizes on exit"));
+    auto time_trace = llvm::cl::opt<std::string>(
+        "time-trace", llvm::cl::desc("Write a Chrome trace of the phases and passes on the main thread to this file"));
+    auto time_trace_granularity = llvm::cl::opt<unsigned>(
+        "time-trace-granularity", llvm::cl::desc("Minimum duration of a --time-trace entry in microseconds"),
+        llvm::cl::init(0u));
+    auto perf_map = llvm::cl::opt<bool>(
+        "perf-map", llvm::cl::desc("List the compiled functions in /tmp/perf-<pid>.map for perf to symbolize"));
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
+    std::ios::sync_with_stdio(false);
+    auto opt_level = std::optional<ks::OptLevel>();
+    if (opt_level_flag.getNumOccurrences() > 0)
+    {
+        opt_level = parse_opt_level(opt_level_flag);
+        if (!opt_level)
+        {
+            std::cerr << std::format("Unknown optimization level -O{}\n", opt_level_flag.getValue());
+            return 1;
+        }
+    }
+    auto lexer = open_input(input_filename);
+    if (!lexer)
+    {
+        std::cout << llvm::toString(lexer.takeError());
+        return 0;
+    }
+    auto parser = ks::Parser(std::move(*lexer));
+    const auto aot_outputs = AOTOutputs{.object_path = emit_obj, .library_path = emit_lib, .header_path = emit_header};
+    if (aot_outputs.any())
+    {
+        return run_aot(parser, aot_outputs, opt_level) ? 0 : 1;
+    }
+
+    auto statistics = stats ? std::make_unique<ks::Statistics>() : nullptr;
+    if (!time_trace.empty())
+    {
+        llvm::timeTraceProfilerInitialize(time_trace_granularity, "kaleidoscope");
+    }
+
+    // Tiered mode must not block on the compiler, so it always gets at least one compile thread.
+    const auto compile_threads = tiered && threads == 0u ? 1u : threads.getValue();
+    const auto jit_options = ks::JITOptions{.lazy = lazy,
+                                            .compile_threads = compile_threads,
+                                            .cache_directory = cache_dir,
+                                            .statistics = statistics.get(),
+                                            .perf_map = perf_map};
+    auto engine = ks::Engine::create(
+        ks::EngineOptions{.jit = jit_options, .opt_level = opt_level, .prelude_object = ks::prelude_object()});
+    if (!engine)
+    {
+        std::cout << llvm::toString(engine.takeError());
+        return 0;
+    }
+    auto& jit_compiler = (*engine)->get_jit_compiler();
+    auto& env = (*engine)->get_environment();
+    auto ok = true;
+    if (tiered)
+    {
+        ok = run_tiered(parser, jit_compiler, env, hot_threshold, statistics.get());
+    }
+    else if (reoptimize)
+    {
+        ok = run_reoptimizing(parser, jit_compiler, env, hot_threshold, statistics.get());
+    }
+    else if (hot_swap)
+    {
+        ok = run_hot_swapping(parser, jit_compiler, env, statistics.get());
+    }
+    else if (batch)
+    {
+        ok = run_batch(parser, jit_compiler, env, threads > 0u ? batch_chunk : 0u, statistics.get());
+    }
+    else
+    {
+        run_interactive(parser, jit_compiler, env, statistics.get());
+    }
+
+    if (jit_compiler.is_lazy())
+    {
+        std::cerr << std::format("{} of {} functions were never compiled\n",
+                                 jit_compiler.count_unmaterialized_functions(), jit_compiler.count_added_functions());
+    }
+    if (statistics)
+    {
+        statistics->print(llvm::errs());
+    }
+    if (!time_trace.empty())
+    {
+        if (auto err = llvm::timeTraceProfilerWrite(time_trace, "-"))
+        {
+            std::cerr << llvm::toString(std::move(err)) << '\n';
+            ok = false;
+        }
+        llvm::timeTraceProfilerCleanup();
+    }
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,89 @@
+#include "object_cache.hpp"
+
+#include <format>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/raw_ostream.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+llvm::Expected<std::unique_ptr<ObjectCache>> ObjectCache::create(std::string directory, std::string target_key)
+{
+    if (const auto ec = llvm::sys::fs::create_directories(directory))
+    {
+        return llvm::createFileError(directory, ec);
+    }
+    return std::make_unique<ObjectCache>(std::move(directory), std::move(target_key));
+}
+
+std::string ObjectCache::object_path(const llvm::Module& module) const
+{
+    auto ir = std::string();
+    auto os = llvm::raw_string_ostream(ir);
+    module.print(os, nullptr);
+    os.flush();
+
+    auto hasher = llvm::SHA256();
+    hasher.update(this->target_key);
+    hasher.update(ir);
+    const auto digest = hasher.final();
+
+    auto path = llvm::SmallString<128>(this->directory);
+    llvm::sys::path::append(path, std::format("{}.o", llvm::toHex(digest, /*LowerCase=*/true)));
+    return std::string(path);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> ObjectCache::getObject(const llvm::Module* module)
+{
+    auto path = this->object_path(*module);
+    auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (buffer)
+    {
+        ++this->hits;
+        return std::move(*buffer);
+    }
+
+    ++this->misses;
+    const auto lock = std::lock_guard(this->pending_mutex);
+    this->pending_paths[module] = std::move(path);
+    return nullptr;
+}
+
+void ObjectCache::notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object)
+{
+    auto path = std::string();
+    {
+        const auto lock = std::lock_guard(this->pending_mutex);
+        if (auto it = this->pending_paths.find(module); it != this->pending_paths.end())
+        {
+            path = std::move(it->second);
+            this->pending_paths.erase(it);
+        }
+    }
+    if (path.empty())
+    {
+        path = this->object_path(*module);
+    }
+
+    // Written through a temporary file and renamed into place, so a concurrent reader never sees a partial object.
+    auto err = llvm::writeToOutput(path, [&object](llvm::raw_ostream& os) {
+        os << object.getBuffer();
+        return llvm::Error::success();
+    });
+    if (err)
+    {
+        llvm::errs() << std::format("Failed to cache object: {}\n", llvm::toString(std::move(err)));
+    }
+}
+} // namespace ks
@@ -0,0 +1,118 @@
+#include "optimizer.hpp"
+
+#include <optional>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace ks
+{
+
+namespace
+{
+llvm::PipelineTuningOptions tuning_options(const llvm::OptimizationLevel level)
+{
+    // Like clang: vectorize from -O2 on and at -Os, but not at -Oz.
+    const auto vectorize = level.getSpeedupLevel() > 1u && level.getSizeLevel() < 2u;
+    auto options = llvm::PipelineTuningOptions();
+    options.LoopVectorization = vectorize;
+    options.SLPVectorization = vectorize;
+    return options;
+}
+} // namespace
+
+OptimizationPipeline::OptimizationPipeline()
+    : pass_builder(nullptr, llvm::PipelineTuningOptions(), std::nullopt, &this->pass_instrumentation_callbacks)
+{
+    this->register_analyses();
+    this->inliner_pass_manager.addPass(llvm::AlwaysInlinerPass(/*InsertLifetimeIntrinsics=*/false));
+    this->function_pass_manager.addPass(llvm::InstCombinePass());
+    this->function_pass_manager.addPass(llvm::ReassociatePass());
+    this->function_pass_manager.addPass(llvm::GVNPass());
+    this->function_pass_manager.addPass(llvm::SimplifyCFGPass());
+
+    auto cleanup = llvm::FunctionPassManager();
+    cleanup.addPass(llvm::InstCombinePass());
+    cleanup.addPass(llvm::GVNPass());
+    cleanup.addPass(llvm::SimplifyCFGPass());
+    this->module_pass_manager.addPass(llvm::AlwaysInlinerPass(/*InsertLifetimeIntrinsics=*/false));
+    this->module_pass_manager.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(cleanup)));
+}
+
+OptimizationPipeline::OptimizationPipeline(const llvm::OptimizationLevel _level,
+                                           std::unique_ptr<llvm::TargetMachine> _target_machine)
+    : target_machine(std::move(_target_machine)),
+      pass_builder(this->target_machine.get(), tuning_options(_level), std::nullopt,
+                   &this->pass_instrumentation_callbacks),
+      level(_level)
+{
+    this->register_analyses();
+    this->inliner_pass_manager.addPass(llvm::AlwaysInlinerPass(/*InsertLifetimeIntrinsics=*/false));
+    this->module_pass_manager = this->pass_builder.buildPerModuleDefaultPipeline(_level);
+}
+
+void OptimizationPipeline::register_analyses()
+{
+    this->time_profiling_passes.registerCallbacks(this->pass_instrumentation_callbacks);
+    this->pass_builder.registerModuleAnalyses(this->module_analysis_manager);
+    this->pass_builder.registerCGSCCAnalyses(this->cgscc_analysis_manager);
+    this->pass_builder.registerFunctionAnalyses(this->function_analysis_manager);
+    this->pass_builder.registerLoopAnalyses(this->loop_analysis_manager);
+    this->pass_builder.crossRegisterProxies(this->loop_analysis_manager, this->function_analysis_manager,
+                                            this->cgscc_analysis_manager, this->module_analysis_manager);
+}
+
+void OptimizationPipeline::run(llvm::Function& fun)
+{
+    const auto scope = Statistics::Scope(this->statistics, Phase::OPTIMIZATION, fun.getName());
+    this->function_pass_manager.run(fun, this->function_analysis_manager);
+}
+
+void OptimizationPipeline::run(llvm::Module& module)
+{
+    const auto scope = Statistics::Scope(this->statistics, Phase::OPTIMIZATION);
+    this->module_pass_manager.run(module, this->module_analysis_manager);
+}
+
+void OptimizationPipeline::run_inliner(llvm::Module& module)
+{
+    const auto scope = Statistics::Scope(this->statistics, Phase::OPTIMIZATION);
+    this->inliner_pass_manager.run(module, this->module_analysis_manager);
+}
+
+void OptimizationPipeline::optimize(llvm::Module& module)
+{
+    for (auto& fun : module)
+    {
+        if (!fun.isDeclaration())
+        {
+            this->run(fun);
+        }
+    }
+    this->run(module);
+    this->reset();
+}
+
+void OptimizationPipeline::reset()
+{
+    this->loop_analysis_manager.clear();
+    this->function_analysis_manager.clear();
+    this->cgscc_analysis_manager.clear();
+    this->module_analysis_manager.clear();
+}
+} // namespace ks
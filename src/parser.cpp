@@ -6,13 +6,22 @@
 #include <optional>
 #include <sstream>
 
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ADT/SmallVector.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
 #include "ast.hpp"
 #include "lexer.hpp"
 
 namespace ks
 {
 
-static std::unique_ptr<ExprAST> LogError(const std::string_view str)
+static ExprAST* LogError(const std::string_view str)
 {
     std::cerr << std::format("Error: {}\n", str);
     return nullptr;
@@ -30,6 +39,28 @@ static std::unique_ptr<PrototypeAST> LogErrorP(const std::string_view str)
     return nullptr;
 }
 
+namespace
+{
+struct ArrayForms
+{
+    Symbol len = Symbol::intern("len");
+    Symbol map = Symbol::intern("map");
+    Symbol zip = Symbol::intern("zip");
+    Symbol reduce = Symbol::intern("reduce");
+
+    bool contains(const Symbol name) const
+    {
+        return name == this->len || name == this->map || name == this->zip || name == this->reduce;
+    }
+};
+
+const ArrayForms& array_forms()
+{
+    static const auto forms = ArrayForms();
+    return forms;
+}
+} // namespace
+
 Token Parser::get_next_token()
 {
     return this->current_token = this->lexer.get_token();
@@ -40,35 +71,35 @@ std::unique_ptr<PrototypeAST> Parser::gen_annon_expr()
     const auto id = this->annon++;
     auto ss = std::stringstream();
     ss << "__annon_expr" << id;
-    return std::make_unique<PrototypeAST>(ss.str(), std::vector<std::string>());
+    return std::make_unique<PrototypeAST>(Symbol::intern(ss.str()), std::vector<Symbol>());
 }
 
-std::optional<std::vector<std::unique_ptr<ExprAST>>> Parser::parse_args()
+std::optional<std::span<ExprAST*>> Parser::parse_args()
 {
-    auto args = std::vector<std::unique_ptr<ExprAST>>();
+    auto args = llvm::SmallVector<ExprAST*, 8>();
     while (this->current_token.ty != TokenType::RIGHT_PAREN)
     {
         if (auto arg = parse_expression())
         {
-            args.push_back(std::move(arg));
+            args.push_back(arg);
         }
         else
         {
             return std::nullopt;
         }
     }
-    return args;
+    return this->arena->copy_array<ExprAST*>(args);
 }
 
 /// call-expr
 ///     ::= expression expression*
-std::unique_ptr<ExprAST> Parser::parse_call_expression()
+ExprAST* Parser::parse_call_expression()
 {
     if (this->current_token.ty != TokenType::IDENTIFIER)
     {
         return LogError(std::format("Expected identifier, found {}", this->current_token));
     }
-    const auto callee = this->current_token.str;
+    const auto callee = this->current_token.symbol;
 
     // Eat callee.
     this->get_next_token();
@@ -76,7 +107,7 @@ std::unique_ptr<ExprAST> Parser::parse_call_expression()
     auto args = parse_args();
     if (args.has_value())
     {
-        return std::make_unique<CallExprAST>(std::move(callee), std::move(args.value()));
+        return this->arena->make<CallExprAST>(callee, args.value());
     }
     else
     {
@@ -84,30 +115,130 @@ std::unique_ptr<ExprAST> Parser::parse_call_expression()
     }
 }
 
+/// if-expr
+///     ::= 'if' expression expression expression
+ExprAST* Parser::parse_if_expression()
+{
+    // Eat the 'if'.
+    this->get_next_token();
+    const auto cond = this->parse_expression();
+    if (cond == nullptr)
+    {
+        return nullptr;
+    }
+    const auto then = this->parse_expression();
+    if (then == nullptr)
+    {
+        return nullptr;
+    }
+    const auto otherwise = this->parse_expression();
+    if (otherwise == nullptr)
+    {
+        return nullptr;
+    }
+    if (this->current_token.ty != TokenType::RIGHT_PAREN)
+    {
+        return LogError(std::format("Expected ')' after the else branch, found {}", this->current_token));
+    }
+    return this->arena->make<IfExprAST>(cond, then, otherwise);
+}
+
+/// array-expr
+///     ::= 'len' expression
+///     ::= 'map' identifier expression expression
+///     ::= 'zip' identifier expression expression expression
+///     ::= 'reduce' identifier expression expression
+ExprAST* Parser::parse_array_expression()
+{
+    const auto& forms = array_forms();
+    const auto form = this->current_token.symbol;
+    // Eat the form's name.
+    this->get_next_token();
+
+    auto fun = Symbol();
+    if (form != forms.len)
+    {
+        if (this->current_token.ty != TokenType::IDENTIFIER)
+        {
+            return LogError(std::format("Expected a function name after `{}`, found {}", form, this->current_token));
+        }
+        fun = this->current_token.symbol;
+        // Eat the function name.
+        this->get_next_token();
+    }
+
+    const auto args = this->parse_args();
+    if (!args.has_value())
+    {
+        return nullptr;
+    }
+    const auto expected = form == forms.zip ? 3u : form == forms.len ? 1u : 2u;
+    if (args->size() != expected)
+    {
+        return LogError(std::format("`{}` expects {} arguments, passed {}", form, expected, args->size()));
+    }
+
+    if (form == forms.len)
+    {
+        return this->arena->make<LenExprAST>((*args)[0]);
+    }
+    if (form == forms.reduce)
+    {
+        return this->arena->make<ReduceExprAST>(fun, (*args)[0], (*args)[1]);
+    }
+    return this->arena->make<MapExprAST>(fun, args->first(expected - 1u), args->back());
+}
+
+/// list-expr
+///     ::= if-expr
+///     ::= array-expr
+///     ::= call-expr
+ExprAST* Parser::parse_list_expression()
+{
+    if (this->current_token.ty == TokenType::IF)
+    {
+        return this->parse_if_expression();
+    }
+    if (this->current_token.ty == TokenType::IDENTIFIER && array_forms().contains(this->current_token.symbol) &&
+        !this->functions.contains(this->current_token.symbol))
+    {
+        return this->parse_array_expression();
+    }
+    return this->parse_call_expression();
+}
+
 /// expr
 ///     ::= identifier
-///     ::= '(' call-expr ')'
-std::unique_ptr<ExprAST> Parser::parse_expression()
+///     ::= number
+///     ::= '(' list-expr ')'
+ExprAST* Parser::parse_expression()
 {
     if (this->current_token.ty == TokenType::IDENTIFIER)
     {
-        auto expr = std::make_unique<VariableExprAST>(this->current_token.str);
+        auto expr = this->arena->make<VariableExprAST>(this->current_token.symbol);
         // Eat the identifier.
         this->get_next_token();
         return expr;
     }
+    else if (this->current_token.ty == TokenType::NUMBER)
+    {
+        auto expr = this->arena->make<NumberExprAST>(this->current_token.number);
+        // Eat the number.
+        this->get_next_token();
+        return expr;
+    }
     else if (this->current_token.ty == TokenType::LEFT_PAREN)
     {
         // Eat the '('.
         this->get_next_token();
-        auto expr = this->parse_call_expression();
+        auto expr = this->parse_list_expression();
         // Eat the ')'.
         this->get_next_token();
         return expr;
     }
     else
     {
-        return LogError(std::format("Expected '(' or identifier, found {}", this->current_token));
+        return LogError(std::format("Expected '(', identifier or number, found {}", this->current_token));
     }
 }
 
@@ -124,14 +255,14 @@ std::unique_ptr<PrototypeAST> Parser::parse_prototype()
     {
         return LogErrorP(std::format("Expected identifier, found: {}", name));
     }
-    const auto name_str = this->current_token.str;
-    auto args = std::vector<std::string>();
+    const auto name_sym = this->current_token.symbol;
+    auto args = std::vector<Symbol>();
     while (true)
     {
         auto arg = this->get_next_token();
         if (arg.ty == TokenType::IDENTIFIER)
         {
-            args.push_back(this->current_token.str);
+            args.push_back(this->current_token.symbol);
         }
         else if (arg.ty == TokenType::RIGHT_PAREN)
         {
@@ -144,7 +275,9 @@ std::unique_ptr<PrototypeAST> Parser::parse_prototype()
     }
     // Eat the ')'.
     this->get_next_token();
-    return std::make_unique<PrototypeAST>(std::move(name_str), std::move(args));
+    // Recorded before the body is parsed, so that a recursive call is a call too.
+    this->functions.insert(name_sym);
+    return std::make_unique<PrototypeAST>(name_sym, std::move(args));
 }
 
 /// define_statement
@@ -169,8 +302,11 @@ std::unique_ptr<FunctionAST> Parser::parse_define()
         return nullptr;
     }
 
-    auto def = std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
-    std::cout << def->to_string() << std::endl;
+    auto def = std::make_unique<FunctionAST>(std::move(this->arena), std::move(proto), expr);
+    if (this->echo)
+    {
+        std::cout << def->to_string() << std::endl;
+    }
     return def;
 }
 
@@ -186,17 +322,23 @@ std::unique_ptr<PrototypeAST> Parser::parse_extern()
     this->get_next_token();
 
     auto proto = this->parse_prototype();
-    std::cout << proto->to_string() << std::endl;
+    if (this->echo && proto != nullptr)
+    {
+        std::cout << proto->to_string() << std::endl;
+    }
     return proto;
 }
 
 std::unique_ptr<FunctionAST> Parser::parse_top_level_expr()
 {
-    if (auto e = this->parse_call_expression())
+    if (auto e = this->parse_list_expression())
     {
         auto proto = this->gen_annon_expr();
-        auto expr = std::make_unique<FunctionAST>(std::move(proto), std::move(e), true);
-        std::cout << expr->to_string() << std::endl;
+        auto expr = std::make_unique<FunctionAST>(std::move(this->arena), std::move(proto), e, true);
+        if (this->echo)
+        {
+            std::cout << expr->to_string() << std::endl;
+        }
         return expr;
     }
     else
@@ -205,30 +347,44 @@ std::unique_ptr<FunctionAST> Parser::parse_top_level_expr()
     }
 }
 
-std::unique_ptr<FunctionAST> Parser::parse_top_level_identifier()
+std::unique_ptr<FunctionAST> Parser::parse_top_level_atom()
 {
-    if (this->current_token.ty != TokenType::IDENTIFIER)
+    auto body = static_cast<ExprAST*>(nullptr);
+    if (this->current_token.ty == TokenType::IDENTIFIER)
+    {
+        body = this->arena->make<VariableExprAST>(this->current_token.symbol);
+    }
+    else if (this->current_token.ty == TokenType::NUMBER)
     {
-        return LogErrorF(std::format("Expected identifier, found: {}", this->current_token));
+        body = this->arena->make<NumberExprAST>(this->current_token.number);
+    }
+    else
+    {
+        return LogErrorF(std::format("Expected identifier or number, found: {}", this->current_token));
     }
-    const auto name = this->current_token.str;
 
     auto proto = this->gen_annon_expr();
-    auto expr = std::make_unique<FunctionAST>(std::move(proto), std::make_unique<VariableExprAST>(name), true);
-    std::cout << expr->to_string() << std::endl;
+    auto expr = std::make_unique<FunctionAST>(std::move(this->arena), std::move(proto), body, true);
+    if (this->echo)
+    {
+        std::cout << expr->to_string() << std::endl;
+    }
     return expr;
 }
 
 std::optional<Parser::ParseResult> Parser::parse_top_level()
 {
+    // Every top-level form gets a fresh arena; a `FunctionAST` takes it over, anything else drops it here.
+    this->arena = std::make_unique<ASTArena>();
     auto tok = this->get_next_token();
     if (tok.ty == TokenType::END_OF_FILE)
     {
+        this->reached_end = true;
         return std::nullopt;
     }
-    else if (tok.ty == TokenType::IDENTIFIER)
+    else if (tok.ty == TokenType::IDENTIFIER || tok.ty == TokenType::NUMBER)
     {
-        auto expr = this->parse_top_level_identifier();
+        auto expr = this->parse_top_level_atom();
         if (expr == nullptr)
         {
             return std::nullopt;
@@ -242,7 +398,7 @@ std::optional<Parser::ParseResult> Parser::parse_top_level()
     {
         tok = this->get_next_token();
         ParseResult result;
-        if (tok.ty == TokenType::IDENTIFIER || tok.ty == TokenType::LEFT_PAREN)
+        if (tok.ty == TokenType::IDENTIFIER || tok.ty == TokenType::LEFT_PAREN || tok.ty == TokenType::IF)
         {
             auto expr = this->parse_top_level_expr();
             if (expr == nullptr)
@@ -271,7 +427,7 @@ std::optional<Parser::ParseResult> Parser::parse_top_level()
         }
         else
         {
-            LogError(std::format("at parse_top_level(): expected identifier, define "
+            LogError(std::format("at parse_top_level(): expected identifier, if, define "
                                  "or extern, found {}",
                                  this->current_token));
             return std::nullopt;
@@ -0,0 +1,145 @@
+#include "perf_map.hpp"
+
+#include <algorithm>
+#include <format>
+#include <iostream>
+#include <iterator>
+#include <utility>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+namespace
+{
+void report(llvm::Error err)
+{
+    if (err)
+    {
+        std::cerr << std::format("Cannot update the perf map: {}\n", llvm::toString(std::move(err)));
+    }
+}
+} // namespace
+
+llvm::Expected<std::unique_ptr<PerfMapListener>> PerfMapListener::create()
+{
+    auto path = std::format("/tmp/perf-{}.map", llvm::sys::Process::getProcessId());
+    auto ec = std::error_code();
+    auto file = llvm::raw_fd_ostream(path, ec, llvm::sys::fs::OF_Text);
+    if (ec)
+    {
+        return llvm::createFileError(path, ec);
+    }
+    return std::make_unique<PerfMapListener>(std::move(path));
+}
+
+void PerfMapListener::notifyObjectLoaded(const ObjectKey key, const llvm::object::ObjectFile& object,
+                                         const llvm::RuntimeDyld::LoadedObjectInfo& info)
+{
+    auto loaded = std::vector<Entry>();
+    for (const auto& [symbol, size] : llvm::object::computeSymbolSizes(object))
+    {
+        const auto type = llvm::expectedToOptional(symbol.getType());
+        if (!type || *type != llvm::object::SymbolRef::ST_Function || size == 0u)
+        {
+            continue;
+        }
+        const auto name = llvm::expectedToOptional(symbol.getName());
+        const auto address = llvm::expectedToOptional(symbol.getAddress());
+        const auto section = llvm::expectedToOptional(symbol.getSection());
+        if (!name || !address || !section || *section == object.section_end())
+        {
+            continue;
+        }
+        // Symbol addresses are relative to the object's own layout; the section tells where it was loaded.
+        const auto load_address = info.getSectionLoadAddress(**section);
+        if (load_address != 0u)
+        {
+            loaded.push_back(Entry{load_address + *address - (*section)->getAddress(), size, name->str()});
+        }
+    }
+
+    const auto lock = std::scoped_lock(this->mutex);
+    if (this->reuses_freed_range(loaded))
+    {
+        this->entries[key] = std::move(loaded);
+        this->freed.clear();
+        report(this->rewrite());
+        return;
+    }
+    report(this->append(loaded));
+    this->entries[key] = std::move(loaded);
+}
+
+void PerfMapListener::notifyFreeingObject(const ObjectKey key)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    if (const auto found = this->entries.find(key); found != this->entries.end())
+    {
+        this->freed.insert(this->freed.end(), std::make_move_iterator(found->second.begin()),
+                           std::make_move_iterator(found->second.end()));
+        this->entries.erase(found);
+    }
+}
+
+bool PerfMapListener::reuses_freed_range(const std::vector<Entry>& loaded) const
+{
+    return std::ranges::any_of(loaded, [this](const Entry& entry) {
+        return std::ranges::any_of(this->freed, [&entry](const Entry& old) {
+            return entry.address < old.address + old.size && old.address < entry.address + entry.size;
+        });
+    });
+}
+
+llvm::Error PerfMapListener::append(const std::vector<Entry>& loaded) const
+{
+    auto ec = std::error_code();
+    auto file = llvm::raw_fd_ostream(this->path, ec, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text);
+    if (ec)
+    {
+        return llvm::createFileError(this->path, ec);
+    }
+    for (const auto& entry : loaded)
+    {
+        file << std::format("{:x} {:x} {}\n", entry.address, entry.size, entry.name);
+    }
+    return llvm::Error::success();
+}
+
+llvm::Error PerfMapListener::rewrite() const
+{
+    // Written aside and renamed over the map, so perf never reads a half-written file.
+    const auto temporary = this->path + ".tmp";
+    {
+        auto ec = std::error_code();
+        auto file = llvm::raw_fd_ostream(temporary, ec, llvm::sys::fs::OF_Text);
+        if (ec)
+        {
+            return llvm::createFileError(temporary, ec);
+        }
+        for (const auto& [key, loaded] : this->entries)
+        {
+            for (const auto& entry : loaded)
+            {
+                file << std::format("{:x} {:x} {}\n", entry.address, entry.size, entry.name);
+            }
+        }
+    }
+    if (const auto ec = llvm::sys::fs::rename(temporary, this->path))
+    {
+        return llvm::createFileError(this->path, ec);
+    }
+    return llvm::Error::success();
+}
+} // namespace ks
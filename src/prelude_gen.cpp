@@ -0,0 +1,63 @@
+#include <format>
+#include <iostream>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/raw_ostream.h>
+#include <string>
+
+#include "emitter.hpp"
+#include "environment.hpp"
+
+/// Writes `object` as the C++ definition of `ks::prelude_object`.
+static llvm::Error write_source(llvm::ArrayRef<char> object, llvm::StringRef path)
+{
+    return llvm::writeToOutput(path, [object](llvm::raw_ostream& os) {
+        os << "// Generated by kaleidoscope_prelude_gen; do not edit.\n"
+              "#include \"prelude.hpp\"\n\n"
+              "namespace ks\n{\n\nnamespace\n{\n"
+              "// Object file readers check the alignment of their buffer.\n"
+              "alignas(16) constexpr unsigned char bytes[] = {";
+        for (auto idx = std::size_t(0); idx < object.size(); ++idx)
+        {
+            os << (idx % 16u == 0u ? "\n    " : " ")
+               << std::format("0x{:02x},", static_cast<unsigned char>(object[idx]));
+        }
+        os << "\n};\n} // namespace\n\n"
+              "std::string_view prelude_object()\n{\n"
+              "    return std::string_view(reinterpret_cast<const char*>(bytes), sizeof(bytes));\n"
+              "}\n} // namespace ks\n";
+        return llvm::Error::success();
+    });
+}
+
+/// Compiles the predefined operators for the host architecture, with every definition exported, so the engine can
+/// link them at startup instead of generating and compiling them.
+int main(int argc, char** argv)
+{
+    auto output = llvm::cl::opt<std::string>("o", llvm::cl::desc("Write the C++ source embedding the object here"),
+                                             llvm::cl::Required);
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope prelude generator\n");
+
+    const auto report = [](llvm::Error err) {
+        if (err)
+        {
+            std::cerr << llvm::toString(std::move(err)) << '\n';
+            return 1;
+        }
+        return 0;
+    };
+
+    auto emitter = ks::ObjectEmitter::create();
+    if (!emitter)
+    {
+        return report(emitter.takeError());
+    }
+    auto env = ks::CodeGenEnvironment::predefined_operators(emitter->get_data_layout());
+    env.finalize_module();
+    auto object = emitter->emit_object(*env.module, /*internalize=*/false);
+    if (!object)
+    {
+        return report(object.takeError());
+    }
+    return report(write_source(*object, output));
+}
@@ -0,0 +1,293 @@
+#include "reoptimizer.hpp"
+
+#include <algorithm>
+#include <format>
+#include <iostream>
+#include <string>
+#include <utility>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+#include "optimizer.hpp"
+
+namespace ks
+{
+
+Reoptimizer::Reoptimizer(JITCompiler& _jit_compiler, std::unique_ptr<llvm::orc::IndirectStubsManager> _stubs,
+                         const std::uint64_t _hot_threshold)
+    : jit_compiler(_jit_compiler), hot_threshold(_hot_threshold), versions(_jit_compiler, std::move(_stubs))
+{
+}
+
+llvm::Expected<std::unique_ptr<Reoptimizer>> Reoptimizer::create(JITCompiler& jit_compiler,
+                                                                 const std::uint64_t hot_threshold)
+{
+    auto stubs = jit_compiler.create_indirect_stubs_manager();
+    if (!stubs)
+    {
+        return stubs.takeError();
+    }
+    return std::make_unique<Reoptimizer>(jit_compiler, std::move(*stubs), hot_threshold);
+}
+
+void Reoptimizer::declare(const PrototypeAST& proto)
+{
+    this->versions.declare(proto);
+}
+
+bool Reoptimizer::define(std::unique_ptr<FunctionAST> fun)
+{
+    const auto name = fun->get_prototype().get_name();
+    auto id = std::uint32_t(0);
+    {
+        const auto lock = std::scoped_lock(this->mutex);
+        if (this->functions.contains(name))
+        {
+            return VersionedStubs::LogError(std::format("Function `{}` cannot be redefined.", name));
+        }
+        this->versions.declare(fun->get_prototype());
+        id = static_cast<std::uint32_t>(this->ids.size());
+    }
+
+    auto env = this->versions.generate(name, *fun, 0u);
+    if (!env)
+    {
+        this->versions.forget(name);
+        return false;
+    }
+    const auto v0 = env->module->getFunction(VersionedStubs::version_name(name, 0u));
+    const auto sites = find_branch_sites(*v0);
+    auto counts = std::make_unique<std::uint64_t[]>(1u + 2u * sites.size());
+    this->instrument(*v0, sites, counts.get(), id);
+    auto compiled = this->versions.compile(*env, name, 0u);
+    if (!compiled)
+    {
+        this->versions.forget(name);
+        return VersionedStubs::LogError(llvm::toString(compiled.takeError()));
+    }
+    if (!this->versions.define_stub(name, *compiled))
+    {
+        return false;
+    }
+
+    const auto lock = std::scoped_lock(this->mutex);
+    this->ids.push_back(name);
+    this->functions[name] = ProfiledFunction{std::move(fun), std::move(counts), sites.size(), 0u};
+    return true;
+}
+
+std::vector<llvm::Instruction*> Reoptimizer::find_branch_sites(llvm::Function& fun)
+{
+    auto sites = std::vector<llvm::Instruction*>();
+    for (auto& bb : fun)
+    {
+        for (auto& inst : bb)
+        {
+            if (const auto br = llvm::dyn_cast<llvm::BranchInst>(&inst); br != nullptr && br->isConditional())
+            {
+                sites.push_back(br);
+            }
+            else if (const auto select = llvm::dyn_cast<llvm::SelectInst>(&inst);
+                     select != nullptr && select->getCondition()->getType()->isIntegerTy(1u))
+            {
+                sites.push_back(select);
+            }
+        }
+    }
+    return sites;
+}
+
+void Reoptimizer::instrument(llvm::Function& fun, std::span<llvm::Instruction* const> sites, std::uint64_t* counts,
+                             const std::uint32_t id) const
+{
+    auto& context = fun.getContext();
+    auto builder = llvm::IRBuilder<>(context);
+    const auto i64 = builder.getInt64Ty();
+    const auto ptr = builder.getPtrTy();
+    const auto base = llvm::ConstantExpr::getIntToPtr(
+        builder.getInt64(llvm::orc::ExecutorAddr::fromPtr(counts).getValue()), ptr);
+    const auto increment = [&](llvm::Value* counter) {
+        return builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter, builder.getInt64(1u), llvm::MaybeAlign(8u),
+                                       llvm::AtomicOrdering::Monotonic);
+    };
+
+    for (auto idx = std::size_t(0); idx < sites.size(); ++idx)
+    {
+        const auto site = sites[idx];
+        builder.SetInsertPoint(site);
+        const auto condition = llvm::isa<llvm::BranchInst>(site) ? llvm::cast<llvm::BranchInst>(site)->getCondition()
+                                                                 : llvm::cast<llvm::SelectInst>(site)->getCondition();
+        const auto taken = builder.CreateConstInBoundsGEP1_64(i64, base, 1u + 2u * idx, "taken.count");
+        const auto not_taken = builder.CreateConstInBoundsGEP1_64(i64, base, 2u + 2u * idx, "not_taken.count");
+        increment(builder.CreateSelect(condition, taken, not_taken, "branch.count"));
+    }
+
+    builder.SetInsertPoint(&*fun.getEntryBlock().getFirstInsertionPt());
+    const auto calls = increment(base);
+    if (this->hot_threshold == 0u)
+    {
+        return;
+    }
+    const auto is_hot = builder.CreateICmpEQ(calls, builder.getInt64(this->hot_threshold - 1u), "is_hot");
+    const auto cold = llvm::MDBuilder(context).createBranchWeights(1u, 1u << 20u);
+    const auto then = llvm::SplitBlockAndInsertIfThen(is_hot, llvm::cast<llvm::Instruction>(is_hot)->getNextNode(),
+                                                      /*Unreachable=*/false, cold);
+    builder.SetInsertPoint(then);
+    const auto callback_type = llvm::FunctionType::get(builder.getVoidTy(), {ptr, builder.getInt32Ty()}, false);
+    const auto callback = llvm::ConstantExpr::getIntToPtr(
+        builder.getInt64(llvm::orc::ExecutorAddr::fromPtr(&request_reoptimization).getValue()), ptr);
+    const auto self = llvm::ConstantExpr::getIntToPtr(
+        builder.getInt64(llvm::orc::ExecutorAddr::fromPtr(this).getValue()), ptr);
+    builder.CreateCall(callback_type, callback, {self, builder.getInt32(id)});
+    llvm::verifyFunction(fun);
+}
+
+void Reoptimizer::attach_profile(llvm::Function& fun, std::span<const std::uint64_t> counts)
+{
+    fun.setEntryCount(counts[0]);
+    const auto sites = find_branch_sites(fun);
+    if (counts.size() != 1u + 2u * sites.size())
+    {
+        return;
+    }
+    auto weights = llvm::MDBuilder(fun.getContext());
+    for (auto idx = std::size_t(0); idx < sites.size(); ++idx)
+    {
+        auto taken = counts[1u + 2u * idx];
+        auto not_taken = counts[2u + 2u * idx];
+        if (taken == 0u && not_taken == 0u)
+        {
+            continue;
+        }
+        // Branch weights are 32 bits wide; only their ratio matters.
+        const auto scale = std::max(taken, not_taken) / 0xffffffffu + 1u;
+        sites[idx]->setMetadata(llvm::LLVMContext::MD_prof,
+                                weights.createBranchWeights(static_cast<std::uint32_t>(taken / scale),
+                                                            static_cast<std::uint32_t>(not_taken / scale)));
+    }
+}
+
+std::vector<std::uint64_t> Reoptimizer::snapshot_counts(const Symbol name)
+{
+    const auto fun = this->functions.find(name);
+    if (fun == nullptr)
+    {
+        return {};
+    }
+    auto counts = std::vector<std::uint64_t>(1u + 2u * fun->sites);
+    for (auto idx = std::size_t(0); idx < counts.size(); ++idx)
+    {
+        counts[idx] = std::atomic_ref<std::uint64_t>(fun->counts[idx]).load(std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+void Reoptimizer::request_reoptimization(Reoptimizer* self, const std::uint32_t id)
+{
+    auto name = Symbol();
+    {
+        const auto lock = std::scoped_lock(self->mutex);
+        name = self->ids[id];
+    }
+    self->versions.post([self, name]() { self->reoptimize(name); });
+}
+
+void Reoptimizer::reoptimize(const Symbol name)
+{
+    auto ast = static_cast<FunctionAST*>(nullptr);
+    auto counts = std::vector<std::uint64_t>();
+    auto version = 0u;
+    {
+        const auto lock = std::scoped_lock(this->mutex);
+        auto& fun = this->functions[name];
+        ast = fun.ast.get();
+        version = ++fun.version;
+        counts = this->snapshot_counts(name);
+    }
+
+    // Every version is generated by the same code, so it has the same branch sites as the instrumented one.
+    auto env = this->versions.generate(name, *ast, version);
+    if (!env)
+    {
+        std::cerr << std::format("Reoptimizing `{}` failed\n", name);
+        return;
+    }
+    attach_profile(*env->module->getFunction(VersionedStubs::version_name(name, version)), counts);
+
+    // One level of callees is imported, each with its own profile, as candidates for inlining.
+    auto callees = std::vector<Symbol>();
+    for (const auto& declaration : *env->module)
+    {
+        if (declaration.isDeclaration())
+        {
+            callees.push_back(Symbol::intern(std::string_view(declaration.getName())));
+        }
+    }
+    for (const auto callee : callees)
+    {
+        auto callee_ast = static_cast<FunctionAST*>(nullptr);
+        auto callee_counts = std::vector<std::uint64_t>();
+        {
+            const auto lock = std::scoped_lock(this->mutex);
+            if (const auto profiled = this->functions.find(callee))
+            {
+                callee_ast = profiled->ast.get();
+                callee_counts = this->snapshot_counts(callee);
+            }
+        }
+        if (callee_ast == nullptr)
+        {
+            continue;
+        }
+        if (const auto body = callee_ast->codegen(*env))
+        {
+            attach_profile(*body, callee_counts);
+            body->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        }
+    }
+
+    auto target_machine = this->jit_compiler.create_target_machine();
+    if (!target_machine)
+    {
+        std::cerr << llvm::toString(target_machine.takeError()) << '\n';
+        return;
+    }
+    env->module->setTargetTriple((*target_machine)->getTargetTriple().str());
+    auto pipeline = OptimizationPipeline(llvm::OptimizationLevel::O3, std::move(*target_machine));
+    pipeline.run(*env->module);
+    pipeline.reset();
+    for (auto& fun : *env->module)
+    {
+        if (fun.hasAvailableExternallyLinkage())
+        {
+            fun.deleteBody();
+        }
+    }
+    auto compiled = this->versions.compile(*env, name, version);
+    if (!compiled)
+    {
+        std::cerr << llvm::toString(compiled.takeError()) << '\n';
+        return;
+    }
+    if (auto err = this->versions.update_stub(name, compiled->address))
+    {
+        std::cerr << llvm::toString(llvm::joinErrors(std::move(err), compiled->resource_tracker->remove())) << '\n';
+        return;
+    }
+    ++this->reoptimized;
+}
+} // namespace ks
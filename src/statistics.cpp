@@ -0,0 +1,72 @@
+#include "statistics.hpp"
+
+#include <format>
+
+namespace ks
+{
+
+llvm::StringRef Statistics::phase_name(const Phase phase)
+{
+    switch (phase)
+    {
+    case Phase::PARSE:
+        return "Parse";
+    case Phase::IR_GENERATION:
+        return "IR generation";
+    case Phase::OPTIMIZATION:
+        return "Optimization";
+    case Phase::EMISSION:
+        return "Object emission";
+    case Phase::LINKING:
+        return "Linking";
+    case Phase::LOOKUP:
+        return "Symbol lookup";
+    }
+    return "Unknown";
+}
+
+void Statistics::add_time(const Phase phase, const Clock::duration time)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    auto& total = this->phases[static_cast<std::size_t>(phase)];
+    total.time += time;
+    ++total.count;
+}
+
+void Statistics::add_module(const std::size_t _functions, const std::size_t _instructions)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    ++this->modules;
+    this->functions += _functions;
+    this->instructions += _instructions;
+}
+
+void Statistics::add_code_size(const llvm::StringRef function, const std::uint64_t bytes)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    this->code_sizes.emplace_back(function.str(), bytes);
+}
+
+void Statistics::print(llvm::raw_ostream& os) const
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    os << "=== Statistics ===\n";
+    for (auto idx = std::size_t(0); idx < phase_count; ++idx)
+    {
+        const auto& total = this->phases[idx];
+        const auto ms = std::chrono::duration<double, std::milli>(total.time).count();
+        os << std::format("{:<16} {:>12.3f} ms {:>8} times\n", phase_name(static_cast<Phase>(idx)).str(), ms,
+                          total.count);
+    }
+    os << std::format("{} modules, {} functions, {} instructions handed to the JIT\n", this->modules, this->functions,
+                      this->instructions);
+
+    auto total_bytes = std::uint64_t(0);
+    for (const auto& [name, bytes] : this->code_sizes)
+    {
+        os << std::format("{:>8} bytes  {}\n", bytes, name);
+        total_bytes += bytes;
+    }
+    os << std::format("{} bytes of code emitted\n", total_bytes);
+}
+} // namespace ks
@@ -0,0 +1,74 @@
+#include "symbol.hpp"
+
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
+namespace ks
+{
+
+namespace
+{
+class SymbolTable
+{
+  public:
+    SymbolTable()
+    {
+        std::ignore = this->intern("");
+    }
+
+    std::uint32_t intern(std::string_view name)
+    {
+        {
+            const auto lock = std::shared_lock(this->mutex);
+            if (const auto it = this->ids.find(name); it != this->ids.end())
+            {
+                return it->second;
+            }
+        }
+        const auto lock = std::unique_lock(this->mutex);
+        if (const auto it = this->ids.find(name); it != this->ids.end())
+        {
+            return it->second;
+        }
+        const auto id = static_cast<std::uint32_t>(this->names.size());
+        // `std::deque` never relocates its elements, so the views used as keys stay valid.
+        const auto& stored = this->names.emplace_back(name);
+        this->ids.emplace(stored, id);
+        return id;
+    }
+
+    std::string_view str(std::uint32_t id) const
+    {
+        const auto lock = std::shared_lock(this->mutex);
+        return this->names[id];
+    }
+
+  private:
+    // Code is generated on background threads too.
+    mutable std::shared_mutex mutex{};
+    std::deque<std::string> names{};
+    std::unordered_map<std::string_view, std::uint32_t> ids{};
+};
+
+SymbolTable& symbol_table()
+{
+    // Leaked on purpose: symbols may still be formatted by other static destructors.
+    static auto* const table = new SymbolTable();
+    return *table;
+}
+} // namespace
+
+Symbol Symbol::intern(std::string_view name)
+{
+    return Symbol(symbol_table().intern(name));
+}
+
+std::string_view Symbol::str() const
+{
+    return symbol_table().str(this->id);
+}
+} // namespace ks
@@ -0,0 +1,163 @@
+#include "versioned_stubs.hpp"
+
+#include <format>
+#include <iostream>
+#include <utility>
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Weverything"
+#endif
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+namespace ks
+{
+
+VersionedStubs::VersionedStubs(JITCompiler& _jit_compiler, std::unique_ptr<llvm::orc::IndirectStubsManager> _stubs)
+    : jit_compiler(_jit_compiler), stubs(std::move(_stubs))
+{
+    this->worker = std::thread([this]() { this->run_worker(); });
+}
+
+VersionedStubs::~VersionedStubs()
+{
+    {
+        const auto lock = std::scoped_lock(this->mutex);
+        this->stopping = true;
+    }
+    this->wake.notify_one();
+    this->worker.join();
+}
+
+std::string VersionedStubs::version_name(const Symbol name, const unsigned version)
+{
+    return std::format("{}.v{}", name, version);
+}
+
+bool VersionedStubs::LogError(const std::string_view str)
+{
+    std::cerr << str;
+    return false;
+}
+
+void VersionedStubs::declare(const PrototypeAST& proto)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    this->prototypes[proto.get_name()] = std::make_unique<PrototypeAST>(proto);
+}
+
+void VersionedStubs::forget(const Symbol name)
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    this->prototypes.erase(name);
+}
+
+std::optional<PrototypeAST> VersionedStubs::find(const Symbol name) const
+{
+    const auto lock = std::scoped_lock(this->mutex);
+    if (const auto proto = this->prototypes.find(name))
+    {
+        return **proto;
+    }
+    return std::nullopt;
+}
+
+std::optional<CodeGenEnvironment> VersionedStubs::generate(const Symbol name, FunctionAST& ast,
+                                                           const unsigned version) const
+{
+    auto env = CodeGenEnvironment(this->jit_compiler.get_data_layout());
+    {
+        const auto lock = std::scoped_lock(this->mutex);
+        for (const auto key : this->prototypes.get_keys())
+        {
+            env.function_prototypes[key] = std::make_unique<PrototypeAST>(**this->prototypes.find(key));
+        }
+    }
+    const auto fun = ast.codegen(env);
+    if (fun == nullptr)
+    {
+        return std::nullopt;
+    }
+    fun->setName(version_name(name, version));
+    return env;
+}
+
+llvm::Expected<VersionedStubs::CompiledVersion> VersionedStubs::compile(CodeGenEnvironment& env, const Symbol name,
+                                                                        const unsigned version)
+{
+    auto resource_tracker = env.add_to_jit_compiler(this->jit_compiler, true);
+    if (!resource_tracker)
+    {
+        return resource_tracker.takeError();
+    }
+    auto symbol = this->jit_compiler.lookup(version_name(name, version));
+    if (!symbol)
+    {
+        return llvm::joinErrors(symbol.takeError(), (*resource_tracker)->remove());
+    }
+    return CompiledVersion{std::move(*resource_tracker), symbol->getAddress()};
+}
+
+bool VersionedStubs::define_stub(const Symbol name, const CompiledVersion& version)
+{
+    // Until `name` resolves to the stub, nothing can call the version.
+    auto err = this->stubs->createStub(name.str(), version.address,
+                                       llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+    if (!err)
+    {
+        err = this->jit_compiler.define_absolute(name.str(), this->stubs->findStub(name.str(), true));
+    }
+    if (!err)
+    {
+        return true;
+    }
+    this->forget(name);
+    return LogError(llvm::toString(llvm::joinErrors(std::move(err), version.resource_tracker->remove())));
+}
+
+llvm::Error VersionedStubs::update_stub(const Symbol name, const llvm::orc::ExecutorAddr address)
+{
+    return this->stubs->updatePointer(name.str(), address);
+}
+
+void VersionedStubs::post(llvm::unique_function<void()> task)
+{
+    {
+        const auto lock = std::scoped_lock(this->mutex);
+        this->tasks.push_back(std::move(task));
+        ++this->pending;
+    }
+    this->wake.notify_one();
+}
+
+void VersionedStubs::wait_until_idle()
+{
+    auto lock = std::unique_lock(this->mutex);
+    this->idle.wait(lock, [this]() { return this->pending == 0u; });
+}
+
+void VersionedStubs::run_worker()
+{
+    auto lock = std::unique_lock(this->mutex);
+    while (true)
+    {
+        this->wake.wait(lock, [this]() { return this->stopping || !this->tasks.empty(); });
+        if (this->stopping)
+        {
+            return;
+        }
+        auto task = std::move(this->tasks.front());
+        this->tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+        if (--this->pending == 0u)
+        {
+            this->idle.notify_all();
+        }
+    }
+}
+} // namespace ks